@@ -3,18 +3,119 @@
 #include <vector>
 #include <algorithm>
 #include <sstream>
-#include <cctype>     
-#include <variant>     
-#include <optional>    
-#include <string_view> 
+#include <variant>
+#include <optional>
+#include <string_view>
+#include <memory>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <new>
+#include <type_traits>
+#include <initializer_list>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <charconv>
+#include <climits>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <filesystem>
+#include <fstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <pthread.h>
+#include <csignal>
+#include <poll.h>
+#define WITCHER_POSIX 1 // isatty, mmap and read(2) are available
+#else
+#define WITCHER_POSIX 0
+#endif
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#define WITCHER_EPOLL 1 // --serve, --connect and --load are available
+#else
+#define WITCHER_EPOLL 0
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define WITCHER_X86_SIMD 1 // SSE2 is part of x86-64; AVX2 is detected at runtime
+#else
+#define WITCHER_X86_SIMD 0
+#endif
 
 namespace GameConstants {
     const size_t MAX_NAME_LENGTH = 128;       // Logical length limit for names
-    const size_t MAX_ITEMS = 128;             // Generic item limit (inventories, formulae count, etc.)
+    const size_t MAX_ITEMS = 128;             // Max number of known potion formulae
     const size_t MAX_RECIPE_INGREDIENTS = 64; // Max ingredients in a formula or items in loot/trade
-    const size_t MAX_EFFECTIVE_ITEMS = 64;    // Max effective items per bestiary entry
+    const size_t LINE_ARENA_BLOCK_SIZE = 64 * 1024; // Bytes per block of the parser's line arena
+    const size_t OUTPUT_BUFFER_SIZE = 1 << 20;       // Bytes of game output buffered before a write
+    const size_t INPUT_BUFFER_SIZE = 1 << 20;        // Initial read(2) buffer for piped input
+    const size_t PIPELINE_RING_CAPACITY = 256;       // Slots per parser lane in --pipeline mode
+    const size_t PIPELINE_SLOT_ARENA_SIZE = 4 * 1024; // Arena block per pipeline slot (line copy + item lists)
+    const size_t PARALLEL_WINDOW_SIZE = 4096;        // Commands analysed together in --parallel mode
+    const size_t SERVER_MAX_PENDING_LINES = 4096;    // Unanswered lines per connection before the server stops reading
+    const size_t SERVER_MAX_LINE_LENGTH = LINE_ARENA_BLOCK_SIZE; // Longest line a server connection may send
 }
 
+// Counts heap allocations made through the global operator new.
+// Used to verify that the steady-state parse path does not touch the heap.
+// The counting operator new is opt-in: define WITCHER_COUNT_ALLOCATIONS to compile it in.
+// Without it, `enabled` is false and the counters stay at zero.
+namespace AllocationCounter {
+#ifdef WITCHER_COUNT_ALLOCATIONS
+    constexpr bool enabled = true;
+#else
+    constexpr bool enabled = false;
+#endif
+    std::atomic<unsigned long long> allocations{0}; // Number of operator new calls
+    std::atomic<unsigned long long> bytes{0};       // Total bytes requested
+
+    unsigned long long current() {
+        return allocations.load(std::memory_order_relaxed);
+    }
+}
+
+#ifdef WITCHER_COUNT_ALLOCATIONS
+void* operator new(std::size_t size) {
+    AllocationCounter::allocations.fetch_add(1, std::memory_order_relaxed);
+    AllocationCounter::bytes.fetch_add(size, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) { return ::operator new(size); }
+
+// GCC pairs inlined new-expressions with the free() below and reports a mismatch
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::size_t) noexcept { std::free(ptr); }
+#pragma GCC diagnostic pop
+#endif
+
 // Specifies the type of effectiveness an item has against a monster
 enum class EffectivenessType {
     POTION,
@@ -32,67 +133,182 @@ enum class CommandType {
     QUERY_TOTAL_SPECIFIC,
     QUERY_TOTAL_ALL,
     QUERY_EFFECTIVE_AGAINST,
+    QUERY_ITEM_EFFECTIVE_AGAINST,
     QUERY_WHAT_IS_IN,
+    QUERY_WHAT_CAN_BREW,
+    QUERY_STATS,
     EXIT,
     INVALID,
     EMPTY
 };
 
+const size_t COMMAND_TYPE_COUNT = static_cast<size_t>(CommandType::EMPTY) + 1;
+
+// Short label of a command type, used by diagnostics and benchmark reports
+const char* commandTypeName(CommandType type) {
+    switch (type) {
+        case CommandType::LOOT:                    return "loot";
+        case CommandType::TRADE:                   return "trade";
+        case CommandType::BREW:                    return "brew";
+        case CommandType::LEARN_EFFECTIVENESS:     return "learn-effectiveness";
+        case CommandType::LEARN_FORMULA:           return "learn-formula";
+        case CommandType::ENCOUNTER:               return "encounter";
+        case CommandType::QUERY_TOTAL_SPECIFIC:    return "query-total-specific";
+        case CommandType::QUERY_TOTAL_ALL:         return "query-total-all";
+        case CommandType::QUERY_EFFECTIVE_AGAINST: return "query-effective-against";
+        case CommandType::QUERY_ITEM_EFFECTIVE_AGAINST: return "query-item-effective-against";
+        case CommandType::QUERY_WHAT_IS_IN:        return "query-what-is-in";
+        case CommandType::QUERY_WHAT_CAN_BREW:     return "query-what-can-brew";
+        case CommandType::QUERY_STATS:             return "query-stats";
+        case CommandType::EXIT:                    return "exit";
+        case CommandType::INVALID:                 return "invalid";
+        case CommandType::EMPTY:                   return "empty";
+    }
+    return "unknown";
+}
+
+// Bump allocator that owns the text and item lists of parsed commands for one batch.
+// Everything handed out stays valid until reset(). Blocks are kept across resets,
+// so once warmed up the arena serves later batches without touching the heap.
+class LineArena {
+private:
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    std::vector<Block> blocks_;
+    size_t block_size_;
+    size_t current_block_ = 0; // Block currently being filled
+    size_t offset_ = 0;        // First free byte within the current block
+
+public:
+    explicit LineArena(size_t block_size = GameConstants::LINE_ARENA_BLOCK_SIZE) : block_size_(block_size) {}
+
+    LineArena(const LineArena&) = delete;
+    LineArena& operator=(const LineArena&) = delete;
+
+    // Returns `bytes` bytes aligned to `alignment` (a power of two, at most alignof(max_align_t))
+    void* allocate(size_t bytes, size_t alignment) {
+        while (current_block_ < blocks_.size()) {
+            Block& block = blocks_[current_block_];
+            size_t aligned = (offset_ + alignment - 1) & ~(alignment - 1);
+            if (aligned + bytes <= block.size) {
+                offset_ = aligned + bytes;
+                return block.data.get() + aligned;
+            }
+            ++current_block_; // Does not fit, move on to the next retained block
+            offset_ = 0;
+        }
+        // Out of retained blocks: grow. Oversized requests get a block of their own.
+        size_t size = std::max(block_size_, bytes);
+        blocks_.push_back(Block{std::unique_ptr<char[]>(new char[size]), size});
+        current_block_ = blocks_.size() - 1;
+        offset_ = bytes;
+        return blocks_.back().data.get();
+    }
+
+    // Allocates an uninitialized array; only trivially destructible types are allowed
+    // since the arena never runs destructors.
+    template <typename T>
+    T* allocateArray(size_t count) {
+        static_assert(std::is_trivially_destructible_v<T>, "LineArena never runs destructors");
+        if (count == 0) return nullptr;
+        return static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+    }
+
+    // Copies text into the arena and returns a view of the copy
+    std::string_view copy(std::string_view text) {
+        if (text.empty()) return std::string_view();
+        char* dest = static_cast<char*>(allocate(text.size(), 1));
+        std::memcpy(dest, text.data(), text.size());
+        return std::string_view(dest, text.size());
+    }
+
+    // Releases everything handed out so far; retained blocks are reused
+    void reset() {
+        current_block_ = 0;
+        offset_ = 0;
+    }
+};
+
 namespace Parsed { // Namespace for parsed command data structures
+    // All names below are views into the line the command was parsed from.
+    // They stay valid as long as that line (usually held by the parser's LineArena) does.
 
     // Basic structure to hold item name and quantity
     struct ItemInfo {
-        std::string name;
+        std::string_view name;
         int quantity;
 
-        ItemInfo(std::string n = "", int q = 0) : name(std::move(n)), quantity(q) {}
+        ItemInfo(std::string_view n = std::string_view(), int q = 0) : name(n), quantity(q) {}
+    };
+
+    // Read-only list of items stored in a LineArena
+    struct ItemSpan {
+        const ItemInfo* items = nullptr;
+        size_t count = 0;
+
+        const ItemInfo* begin() const { return items; }
+        const ItemInfo* end() const { return items + count; }
+        size_t size() const { return count; }
+        bool empty() const { return count == 0; }
     };
 
     // Payload structures for different command types
     // These will be used within the std::variant in Parsed::Command.
     struct LootPayload {
-        std::vector<ItemInfo> items; // Items looted
+        ItemSpan items; // Items looted
     };
 
     struct TradePayload {
-        std::vector<ItemInfo> trophies_to_give;     // Trophies to give in a trade
-        std::vector<ItemInfo> ingredients_to_receive; // Ingredients to receive
+        ItemSpan trophies_to_give;       // Trophies to give in a trade
+        ItemSpan ingredients_to_receive; // Ingredients to receive
     };
 
+    // `count` for "Geralt brews * <Potion>": brew as many as the ingredients allow
+    constexpr int BREW_AS_MANY_AS_POSSIBLE = 0;
+
     struct BrewPayload {
-        std::string potion_name; // Name of the potion to brew
+        std::string_view potion_name; // Name of the potion to brew
+        int count = 1;                // Copies to brew, or BREW_AS_MANY_AS_POSSIBLE
+        bool batch = false;           // True for the "Geralt brews <count> <Potion>" form
     };
 
     struct LearnEffectivenessPayload {
-        std::string item_name;          // Name of the item (potion/sign) whose effectiveness is learned
+        std::string_view item_name;     // Name of the item (potion/sign) whose effectiveness is learned
         EffectivenessType item_type;    // Type of the item (POTION or SIGN)
-        std::string monster_name;       // Name of the monster the item is effective against
+        std::string_view monster_name;  // Name of the monster the item is effective against
     };
 
     struct LearnFormulaPayload {
-        std::string potion_name;            // Name of the potion whose formula is learned
-        std::vector<ItemInfo> requirements; // Ingredients required for the potion
+        std::string_view potion_name; // Name of the potion whose formula is learned
+        ItemSpan requirements;        // Ingredients required for the potion
     };
 
     struct EncounterPayload {
-        std::string monster_name; // Name of the encountered monster
+        std::string_view monster_name; // Name of the encountered monster
     };
 
     struct QueryTotalSpecificPayload {
-        std::string category; // Category being queried ("ingredient", "potion", "trophy")
-        std::string item_name;// Name of the specific item whose total is queried
+        std::string_view category;  // Category being queried ("ingredient", "potion", "trophy")
+        std::string_view item_name; // Name of the specific item whose total is queried
     };
 
     struct QueryTotalAllPayload {
-        std::string category; // Category for which all items are to be listed
+        std::string_view category; // Category for which all items are to be listed
     };
 
     struct QueryEffectiveAgainstPayload {
-        std::string monster_name; // Monster whose effectiveness data is queried
+        std::string_view monster_name; // Monster whose effectiveness data is queried
+    };
+
+    struct QueryItemEffectiveAgainstPayload {
+        std::string_view item_name; // Potion or sign whose monsters are queried
     };
 
     struct QueryWhatIsInPayload {
-        std::string potion_name; // Potion whose ingredients are queried
+        std::string_view potion_name; // Potion whose ingredients are queried
     };
 
     struct EmptyPayload {}; // For commands that don't have specific data (e.g., EXIT, EMPTY)
@@ -112,6 +328,7 @@ namespace Parsed { // Namespace for parsed command data structures
             QueryTotalSpecificPayload,
             QueryTotalAllPayload,
             QueryEffectiveAgainstPayload,
+            QueryItemEffectiveAgainstPayload,
             QueryWhatIsInPayload
         > data;
 
@@ -122,129 +339,307 @@ namespace Parsed { // Namespace for parsed command data structures
 } // namespace Parsed
 
 
-namespace ParserUtils { // Namespace for parsing utility functions
+// ASCII character classification for the parser, with vectorized kernels.
+// Matches std::isalpha/std::isspace in the "C" locale (the program never calls setlocale).
+// The SSE2/AVX2 kernels are chosen once at startup based on the running CPU;
+// other platforms use the scalar kernels.
+namespace AsciiScan {
 
-    // Trims leading and trailing whitespace from a std::string in-place
-    void trim_whitespace_in_place(std::string& s) {
-        s.erase(s.begin(), std::find_if(s.begin(), s.end(), [](unsigned char ch) {
-            return !std::isspace(ch); // Find first non-whitespace character
-        }));
-        s.erase(std::find_if(s.rbegin(), s.rend(), [](unsigned char ch) {
-            return !std::isspace(ch); // Find first non-whitespace character from the end
-        }).base(), s.end());
-    }
-    
-    // Returns a new std::string with leading and trailing whitespace removed
-    std::string trim_whitespace_str(std::string s) {
-        trim_whitespace_in_place(s); // Trim in-place and return the copy
-        return s;
+    constexpr std::array<uint8_t, 256> build_class_table() {
+        std::array<uint8_t, 256> table{};
+        for (char c : std::string_view(" \t\n\r\f\v")) table[static_cast<unsigned char>(c)] = 1;
+        for (int c = 'a'; c <= 'z'; ++c) table[c] = 2;
+        for (int c = 'A'; c <= 'Z'; ++c) table[c] = 2;
+        return table;
     }
 
-    // Tries to parse a quantity (positive integer) from a string token
-    // Returns the quantity if successful, std::nullopt otherwise
-    std::optional<int> parse_quantity(const std::string& token_str) {
-        if (token_str.empty()) return std::nullopt;
-        try {
-            size_t pos; // For std::stol, stores the position of the first unparsed char
-            long val = std::stol(token_str, &pos); // Convert string to long
-            // Validation: entire string parsed? positive? within int limits?
-            if (pos != token_str.length() || val <= 0 || val > 2147483647) {
-                return std::nullopt;
+    constexpr std::array<uint8_t, 256> CHAR_CLASS = build_class_table(); // 1 = space, 2 = letter
+
+    inline bool is_space(char c) { return CHAR_CLASS[static_cast<unsigned char>(c)] == 1; }
+    inline bool is_alpha(char c) { return CHAR_CLASS[static_cast<unsigned char>(c)] == 2; }
+
+    // Kernel set used by the parser; all three assume `data` points to `length` readable bytes
+    struct Kernels {
+        const char* name;
+        // Index of the first non-space byte, or `length` if there is none
+        size_t (*first_non_space)(const char* data, size_t length);
+        // One past the last non-space byte, or 0 if there is none
+        size_t (*end_of_non_space)(const char* data, size_t length);
+        // True if every byte is a letter or a space, and spaces are allowed and never doubled.
+        // `data` must already be trimmed.
+        bool (*is_valid_name)(const char* data, size_t length, bool allow_spaces);
+    };
+
+    size_t first_non_space_scalar(const char* data, size_t length) {
+        size_t i = 0;
+        while (i < length && is_space(data[i])) ++i;
+        return i;
+    }
+
+    size_t end_of_non_space_scalar(const char* data, size_t length) {
+        while (length > 0 && is_space(data[length - 1])) --length;
+        return length;
+    }
+
+    // Scalar name check; `previous_was_space` carries state in from a vector prefix
+    bool is_valid_name_tail(const char* data, size_t length, bool allow_spaces, bool previous_was_space) {
+        for (size_t i = 0; i < length; ++i) {
+            uint8_t cls = CHAR_CLASS[static_cast<unsigned char>(data[i])];
+            if (cls == 2) { // Letter
+                previous_was_space = false;
+            } else if (cls == 1) { // Space: must be allowed and not follow another space
+                if (!allow_spaces || previous_was_space) return false;
+                previous_was_space = true;
+            } else { // Digit, punctuation or non-ASCII byte
+                return false;
             }
-            return static_cast<int>(val);
-        } catch (const std::invalid_argument&) { // e.g., "abc"
-            return std::nullopt;
-        } catch (const std::out_of_range&) {     // Value out of long's range
-            return std::nullopt;
         }
+        return true;
     }
 
-    // Tries to parse a valid item/monster/potion name from a string token
-    std::optional<std::string> parse_name(const std::string& token_str_in, bool allow_spaces) {
-        std::string token_str = trim_whitespace_str(token_str_in); // Trim leading/trailing spaces first
+    bool is_valid_name_scalar(const char* data, size_t length, bool allow_spaces) {
+        return is_valid_name_tail(data, length, allow_spaces, false);
+    }
+
+    const Kernels SCALAR_KERNELS = {"scalar", first_non_space_scalar, end_of_non_space_scalar, is_valid_name_scalar};
+
+#if WITCHER_X86_SIMD
+    // The 16-byte routines are force-inlined into the AVX2 kernels so that their tails are
+    // VEX-encoded too; mixing legacy SSE code with dirty upper YMM state is slow.
+#define WITCHER_ALWAYS_INLINE inline __attribute__((always_inline))
+
+    // Per-lane masks: 0xFF where the byte is a space / a letter
+    WITCHER_ALWAYS_INLINE __m128i space_lanes_sse2(__m128i bytes) {
+        __m128i control = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('\t' - 1)),
+                                        _mm_cmplt_epi8(bytes, _mm_set1_epi8('\r' + 1)));
+        return _mm_or_si128(control, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')));
+    }
+
+    WITCHER_ALWAYS_INLINE __m128i alpha_lanes_sse2(__m128i bytes) {
+        __m128i lower = _mm_or_si128(bytes, _mm_set1_epi8(0x20)); // Folds 'A'..'Z' onto 'a'..'z'
+        return _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                             _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+    }
 
-        if (token_str.empty() || token_str.length() >= GameConstants::MAX_NAME_LENGTH) return std::nullopt;
+    WITCHER_ALWAYS_INLINE unsigned space_bits_sse2(const char* chunk) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(chunk));
+        return static_cast<unsigned>(_mm_movemask_epi8(space_lanes_sse2(bytes)));
+    }
+
+    WITCHER_ALWAYS_INLINE size_t first_non_space_16(const char* data, size_t length) {
+        size_t i = 0;
+        for (; i + 16 <= length; i += 16) {
+            unsigned non_space = ~space_bits_sse2(data + i) & 0xFFFFu;
+            if (non_space) return i + static_cast<size_t>(__builtin_ctz(non_space));
+        }
+        return i + first_non_space_scalar(data + i, length - i);
+    }
 
-        bool char_found = false;        // Has at least one alphabetic character been found?
-        bool last_char_was_space = false; // Was the previous character a space (for consecutive space check)?
-        for (char c_char : token_str) {
-            unsigned char c = static_cast<unsigned char>(c_char);
-            if (std::isalpha(c)) { // If character is a letter
-                char_found = true;
-                last_char_was_space = false;
-            } else if (std::isspace(c)) { // If character is a space
-                if (!allow_spaces) return std::nullopt; // Invalid if spaces are not allowed
-                if (last_char_was_space) return std::nullopt; // Invalid if previous char was also a space
-                last_char_was_space = true;
-            } else { // Invalid character (e.g., number, special symbol)
-                return std::nullopt; 
+    WITCHER_ALWAYS_INLINE size_t end_of_non_space_16(const char* data, size_t length) {
+        for (; length >= 16; length -= 16) {
+            unsigned non_space = ~space_bits_sse2(data + length - 16) & 0xFFFFu;
+            if (non_space) return length - 16 + static_cast<size_t>(32 - __builtin_clz(non_space));
+        }
+        return end_of_non_space_scalar(data, length);
+    }
+
+    WITCHER_ALWAYS_INLINE bool is_valid_name_16(const char* data, size_t length, bool allow_spaces) {
+        unsigned carry = 0; // 1 if the byte before the current chunk was a space
+        size_t i = 0;
+        for (; i + 16 <= length; i += 16) {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            unsigned space = static_cast<unsigned>(_mm_movemask_epi8(space_lanes_sse2(bytes)));
+            unsigned alpha = static_cast<unsigned>(_mm_movemask_epi8(alpha_lanes_sse2(bytes)));
+            if ((space | alpha) != 0xFFFFu) return false;            // Some byte is neither
+            if (space != 0) {
+                if (!allow_spaces) return false;
+                if (space & ((space << 1) | carry)) return false;    // Two spaces in a row
             }
+            carry = (space >> 15) & 1u;
         }
-        if (!char_found) return std::nullopt; // Invalid if no alphabetic characters were found (e.g., string of only spaces)
-        return token_str; // Valid name
+        return is_valid_name_tail(data + i, length - i, allow_spaces, carry != 0);
     }
 
-    // Splits a string by a delimiter and returns a vector of tokens
-    std::vector<std::string> split_string(const std::string& s, char delimiter) {
-        std::vector<std::string> tokens;
-        std::string token;
-        std::istringstream tokenStream(s); // Use a string stream to read from the string
-        while (std::getline(tokenStream, token, delimiter)) { // Read until the delimiter
-            tokens.push_back(token);
+    size_t first_non_space_sse2(const char* data, size_t length) { return first_non_space_16(data, length); }
+    size_t end_of_non_space_sse2(const char* data, size_t length) { return end_of_non_space_16(data, length); }
+    bool is_valid_name_sse2(const char* data, size_t length, bool allow_spaces) { return is_valid_name_16(data, length, allow_spaces); }
+
+    const Kernels SSE2_KERNELS = {"sse2", first_non_space_sse2, end_of_non_space_sse2, is_valid_name_sse2};
+
+    __attribute__((target("avx2"))) inline __m256i space_lanes_avx2(__m256i bytes) {
+        __m256i control = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8('\t' - 1)),
+                                           _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), bytes));
+        return _mm256_or_si256(control, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' ')));
+    }
+
+    __attribute__((target("avx2"))) inline __m256i alpha_lanes_avx2(__m256i bytes) {
+        __m256i lower = _mm256_or_si256(bytes, _mm256_set1_epi8(0x20));
+        return _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+                                _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+    }
+
+    __attribute__((target("avx2"))) inline uint32_t space_bits_avx2(const char* chunk) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(chunk));
+        return static_cast<uint32_t>(_mm256_movemask_epi8(space_lanes_avx2(bytes)));
+    }
+
+    __attribute__((target("avx2"))) size_t first_non_space_avx2(const char* data, size_t length) {
+        size_t i = 0;
+        for (; i + 32 <= length; i += 32) {
+            uint32_t non_space = ~space_bits_avx2(data + i);
+            if (non_space) return i + static_cast<size_t>(__builtin_ctz(non_space));
         }
-        return tokens;
+        return i + first_non_space_16(data + i, length - i);
     }
 
-    // Parses a list of items in "quantity name, quantity name, ..." format
-    // If `item_names_allow_spaces` is true, item names can contain spaces.
-    std::optional<std::vector<Parsed::ItemInfo>> parse_item_list(const std::string& list_str_in, bool item_names_allow_spaces) {
-        std::string list_str = trim_whitespace_str(list_str_in); // Trim the input list string
-        if (list_str.empty()) return std::vector<Parsed::ItemInfo>{}; // An empty list is valid (0 items)
+    __attribute__((target("avx2"))) size_t end_of_non_space_avx2(const char* data, size_t length) {
+        for (; length >= 32; length -= 32) {
+            uint32_t non_space = ~space_bits_avx2(data + length - 32);
+            if (non_space) return length - 32 + static_cast<size_t>(32 - __builtin_clz(non_space));
+        }
+        return end_of_non_space_16(data, length);
+    }
+
+    __attribute__((target("avx2"))) bool is_valid_name_avx2(const char* data, size_t length, bool allow_spaces) {
+        uint32_t carry = 0; // 1 if the byte before the current chunk was a space
+        size_t i = 0;
+        for (; i + 32 <= length; i += 32) {
+            __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+            uint32_t space = static_cast<uint32_t>(_mm256_movemask_epi8(space_lanes_avx2(bytes)));
+            uint32_t alpha = static_cast<uint32_t>(_mm256_movemask_epi8(alpha_lanes_avx2(bytes)));
+            if ((space | alpha) != 0xFFFFFFFFu) return false;
+            if (space != 0) {
+                if (!allow_spaces) return false;
+                if (space & ((space << 1) | carry)) return false;
+            }
+            carry = space >> 31;
+        }
+        if (i == length) return true;
+        if (carry && allow_spaces && is_space(data[i])) return false; // Doubled space across the boundary
+        return is_valid_name_16(data + i, length - i, allow_spaces);
+    }
+
+    const Kernels AVX2_KERNELS = {"avx2", first_non_space_avx2, end_of_non_space_avx2, is_valid_name_avx2};
+#undef WITCHER_ALWAYS_INLINE
+#endif
+
+    // Best kernel set for the running CPU
+    const Kernels& select_kernels() {
+#if WITCHER_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) return AVX2_KERNELS;
+        return SSE2_KERNELS;
+#else
+        return SCALAR_KERNELS;
+#endif
+    }
+
+    const Kernels& ACTIVE = select_kernels();
+} // namespace AsciiScan
+
+
+namespace ParserUtils { // Namespace for parsing utility functions
+
+    // Trims leading and trailing whitespace from a string_view in-place
+    void trim_whitespace_in_place(std::string_view& s) {
+        if (s.empty() || (!AsciiScan::is_space(s.front()) && !AsciiScan::is_space(s.back()))) {
+            return; // Already trimmed, the common case
+        }
+        size_t first = AsciiScan::ACTIVE.first_non_space(s.data(), s.length()); // Find first non-whitespace character
+        size_t end = first + AsciiScan::ACTIVE.end_of_non_space(s.data() + first, s.length() - first); // One past the last one
+        s = s.substr(first, end - first);
+    }
+
+    // Returns a view with leading and trailing whitespace removed
+    std::string_view trim_whitespace(std::string_view s) {
+        trim_whitespace_in_place(s);
+        return s;
+    }
+
+    // Tries to parse a quantity (positive integer) from a string token
+    // Returns the quantity if successful, std::nullopt otherwise.
+    // Accepts what the previous std::stol-based version accepted ([+]digits, 1..INT_MAX,
+    // whole token consumed) without throwing on malformed input.
+    std::optional<int> parse_quantity(std::string_view token) {
+        if (!token.empty() && token.front() == '+') token.remove_prefix(1); // Explicit plus sign is allowed
+        if (token.empty()) return std::nullopt;
+
+        const char* end = token.data() + token.size();
+        int val = 0;
+        std::from_chars_result res = std::from_chars(token.data(), end, val); // Fails on overflow instead of wrapping
+        // Validation: entire string parsed? positive?
+        if (res.ec != std::errc() || res.ptr != end || val <= 0) {
+            return std::nullopt;
+        }
+        return val;
+    }
+
+    // Tries to parse a valid item/monster/potion name from a string token
+    // Returns a view of the trimmed name on success
+    std::optional<std::string_view> parse_name(std::string_view token_in, bool allow_spaces) {
+        std::string_view token = trim_whitespace(token_in); // Trim leading/trailing spaces first
+
+        if (token.empty() || token.length() >= GameConstants::MAX_NAME_LENGTH) return std::nullopt;
 
-        std::vector<Parsed::ItemInfo> parsed_items;
-        std::vector<std::string> tokens = split_string(list_str, ','); // Split by comma
-        
-        // If the string is not empty but split_string returned an empty vector (no commas),
-        // it might be a single item.
-        if (tokens.empty() && !list_str.empty()) {
-             tokens.push_back(list_str); // Treat the whole string as a single token
+        // Letters and (if allowed) single spaces only. A trimmed token starts with a
+        // non-space, so a valid one always contains at least one letter.
+        if (!AsciiScan::ACTIVE.is_valid_name(token.data(), token.length(), allow_spaces)) {
+            return std::nullopt;
         }
+        return token; // Valid name
+    }
+
+    // Parses a list of items in "quantity name, quantity name, ..." format into `arena`
+    // If `item_names_allow_spaces` is true, item names can contain spaces.
+    // A single trailing comma is accepted, as it was with the original getline-based splitter.
+    std::optional<Parsed::ItemSpan> parse_item_list(std::string_view list_str, bool item_names_allow_spaces, LineArena& arena) {
+        trim_whitespace_in_place(list_str); // Trim the input list string
+        if (list_str.empty()) return Parsed::ItemSpan{}; // An empty list is valid (0 items)
+        if (list_str.back() == ',') list_str.remove_suffix(1); // Trailing separator does not start a new token
+
+        size_t token_count = static_cast<size_t>(std::count(list_str.begin(), list_str.end(), ',')) + 1;
+        if (token_count > GameConstants::MAX_RECIPE_INGREDIENTS) return std::nullopt; // Too many items
+
+        Parsed::ItemInfo* items = arena.allocateArray<Parsed::ItemInfo>(token_count);
+        size_t parsed_count = 0;
+
+        while (parsed_count < token_count) { // For each "quantity name" part
+            size_t comma_pos = list_str.find(',');
+            std::string_view token = list_str.substr(0, comma_pos);
+            list_str.remove_prefix(comma_pos == std::string_view::npos ? list_str.length() : comma_pos + 1);
 
-        for (std::string token : tokens) { // For each "quantity name" part
             trim_whitespace_in_place(token); // Trim the token
             if (token.empty()) return std::nullopt; // Empty token (e.g., "1 apple, , 2 pear") is invalid
 
             size_t first_space_pos = token.find(' '); // Find the first space between quantity and name
-            if (first_space_pos == std::string::npos || first_space_pos == 0) return std::nullopt; // No space or space at start
+            if (first_space_pos == std::string_view::npos || first_space_pos == 0) return std::nullopt; // No space or space at start
 
-            std::string qty_str = token.substr(0, first_space_pos); // Quantity string
-            std::string name_str_raw = token.substr(first_space_pos + 1); // Raw name string
-            trim_whitespace_in_place(name_str_raw); // Trim the name string
+            std::string_view qty_str = token.substr(0, first_space_pos); // Quantity string
+            std::string_view name_str = trim_whitespace(token.substr(first_space_pos + 1)); // Name string
 
-            if (name_str_raw.empty()) return std::nullopt; // Name part is empty after quantity
+            if (name_str.empty()) return std::nullopt; // Name part is empty after quantity
 
             std::optional<int> quantity_opt = parse_quantity(qty_str); // Parse quantity
-            std::optional<std::string> name_opt = parse_name(name_str_raw, item_names_allow_spaces); // Parse name
+            std::optional<std::string_view> name_opt = parse_name(name_str, item_names_allow_spaces); // Parse name
 
             if (!quantity_opt || !name_opt) { // If quantity or name is invalid
-                return std::nullopt; 
+                return std::nullopt;
             }
-            
-            if (parsed_items.size() >= GameConstants::MAX_RECIPE_INGREDIENTS) return std::nullopt; // Too many items
-            parsed_items.emplace_back(name_opt.value(), quantity_opt.value()); // Add valid item to list
+
+            new (&items[parsed_count++]) Parsed::ItemInfo(name_opt.value(), quantity_opt.value()); // Add valid item to list
         }
-        return parsed_items; // Parsed list of items
+        return Parsed::ItemSpan{items, parsed_count}; // Parsed list of items
     }
-    
+
     // Complex potion name parsing. A potion name can be terminated by keywords like
     // " potion is effective against", " potion consists of", or a question mark '?'.
     // Returns: <parsed potion name (optional), remaining string_view>
-    std::pair<std::optional<std::string>, std::string_view>
+    std::pair<std::optional<std::string_view>, std::string_view>
     parse_potion_name_complex(std::string_view full_text) {
         std::string_view current_view = full_text;
         // Skip leading whitespace
-        size_t first_char = current_view.find_first_not_of(" \t\n\r\f\v");
-        if (first_char == std::string_view::npos) return {std::nullopt, ""}; // Only whitespace or empty
+        size_t first_char = AsciiScan::ACTIVE.first_non_space(current_view.data(), current_view.length());
+        if (first_char == current_view.length()) return {std::nullopt, ""}; // Only whitespace or empty
         current_view.remove_prefix(first_char);
 
         if (current_view.empty()) return {std::nullopt, ""}; // Empty after skipping whitespace
@@ -252,18 +647,18 @@ namespace ParserUtils { // Namespace for parsing utility functions
         size_t end_pos = std::string_view::npos; // Index of the end of the potion name
         // Potential terminating keyword phrases
         const char* terminators[] = {" potion is effective against", " potion consists of"};
-        
+
         for (const char* term_c_str : terminators) {
             std::string_view term_sv(term_c_str);
             // We need to find the "potion" part of the terminator, not " potion"
-            size_t term_keyword_start = term_sv.find("potion"); 
+            size_t term_keyword_start = term_sv.find("potion");
             if (term_keyword_start == std::string_view::npos) continue; // Error case, should not happen
 
             std::string_view actual_term_to_find = term_sv.substr(term_keyword_start); // e.g., "potion is effective against"
             size_t found_pos = current_view.find(actual_term_to_find); // Search for this in the main text
             if (found_pos != std::string_view::npos) {
                 // Check if "potion" is a whole word (preceded by space or start of string)
-                if (found_pos == 0 || std::isspace(static_cast<unsigned char>(current_view[found_pos-1]))) {
+                if (found_pos == 0 || AsciiScan::is_space(current_view[found_pos-1])) {
                      // If no terminator found yet, or this one ends earlier, take this one
                      if (end_pos == std::string_view::npos || found_pos < end_pos) {
                         end_pos = found_pos;
@@ -271,7 +666,7 @@ namespace ParserUtils { // Namespace for parsing utility functions
                 }
             }
         }
-        
+
         // Also check for '?' as a terminator
         size_t q_mark_pos = current_view.find('?');
         if (q_mark_pos != std::string_view::npos) {
@@ -280,19 +675,18 @@ namespace ParserUtils { // Namespace for parsing utility functions
             }
         }
 
-        std::string potion_name_str;
+        std::string_view potion_name_view;
         std::string_view remainder_view;
 
         if (end_pos == std::string_view::npos) { // If no specific terminator found, whole string is potion name
-            potion_name_str = std::string(current_view);
+            potion_name_view = current_view;
             remainder_view = current_view.substr(current_view.length()); // Remainder is empty
         } else { // Terminator found
-            potion_name_str = std::string(current_view.substr(0, end_pos)); // Potion name is up to terminator
+            potion_name_view = current_view.substr(0, end_pos); // Potion name is up to terminator
             remainder_view = current_view.substr(end_pos); // Remainder is from terminator onwards
         }
-        
-        trim_whitespace_in_place(potion_name_str); // Trim the extracted potion name
-        auto validated_name = parse_name(potion_name_str, true); // Potion names can have spaces
+
+        auto validated_name = parse_name(potion_name_view, true); // Potion names can have spaces
         if (!validated_name || validated_name.value().empty()) { // Invalid or empty name
             return {std::nullopt, full_text}; // Return original text on error
         }
@@ -301,36 +695,16 @@ namespace ParserUtils { // Namespace for parsing utility functions
 
     // Advances a string_view past any leading whitespace
     void advance_past_whitespace(std::string_view& sv) {
-        size_t first_char = sv.find_first_not_of(" \t\n\r\f\v");
-        if (first_char == std::string_view::npos) { // All whitespace
-            sv.remove_prefix(sv.length()); // Empty the string_view
-        } else {
-            sv.remove_prefix(first_char); // Advance to the first non-whitespace character
-        }
+        if (sv.empty() || !AsciiScan::is_space(sv.front())) return; // Nothing to skip
+        sv.remove_prefix(AsciiScan::ACTIVE.first_non_space(sv.data(), sv.length())); // Advance to the first non-whitespace character
     }
 
-    // Tries to match a keyword at the beginning of a string_view.
-    // If matched, advances the string_view past the keyword and subsequent whitespace.
-    // Returns true if matched, false otherwise.
-    bool match_and_advance(std::string_view& sv, const std::string& keyword) {
-        advance_past_whitespace(sv); // Skip leading whitespace first
-        if (sv.rfind(keyword, 0) == 0) { // Does string_view start with the keyword?
-            // Check for whole word match (is it followed by space or end of string?)
-            if (sv.length() == keyword.length() || std::isspace(static_cast<unsigned char>(sv[keyword.length()]))) {
-                sv.remove_prefix(keyword.length()); // Advance past keyword
-                advance_past_whitespace(sv); // Advance past subsequent whitespace
-                return true;
-            }
-        }
-        return false;
-    }
-    
     // Finds a "standalone" substring (keyword) within a text.
     // Standalone: surrounded by whitespace or string boundaries.
     // Returns: <string_view of text after the keyword, start_pos of keyword in original haystack>
     // Returns std::nullopt if not found.
     std::optional<std::pair<std::string_view, size_t>>
-    find_standalone_substring(std::string_view haystack, const std::string& needle) {
+    find_standalone_substring(std::string_view haystack, std::string_view needle) {
         if (needle.empty()) return std::nullopt;
         size_t current_search_offset = 0; // Search start position within haystack
         while (current_search_offset < haystack.length()) {
@@ -341,12 +715,12 @@ namespace ParserUtils { // Namespace for parsing utility functions
 
             bool is_standalone = true;
             // Check character before needle
-            if (found_pos > 0 && !std::isspace(static_cast<unsigned char>(haystack[found_pos - 1]))) {
+            if (found_pos > 0 && !AsciiScan::is_space(haystack[found_pos - 1])) {
                 is_standalone = false;
             }
             // Check character after needle
             char char_after_needle = (found_pos + needle.length() < haystack.length()) ? haystack[found_pos + needle.length()] : '\0';
-            if (char_after_needle != '\0' && !std::isspace(static_cast<unsigned char>(char_after_needle))) {
+            if (char_after_needle != '\0' && !AsciiScan::is_space(char_after_needle)) {
                 is_standalone = false;
             }
 
@@ -357,141 +731,243 @@ namespace ParserUtils { // Namespace for parsing utility functions
                 return std::make_pair(remainder, found_pos);
             }
             // Not standalone, continue search from the character after this found_pos
-            current_search_offset = found_pos + 1; 
+            current_search_offset = found_pos + 1;
         }
         return std::nullopt; // Loop finished, not found
     }
+} // namespace ParserUtils
 
-    // Finds a sequence of keywords in a text.
-    // Returns a pair:
-    //   - first: optional string_view of the text *before* the first keyword of the sequence.
-    //   - second: optional string_view of the text *after* the last matched keyword and its subsequent space.
-    // Returns {std::nullopt, std::nullopt} if the sequence is not found.
-    std::pair<std::optional<std::string_view>, std::optional<std::string_view>>
-    find_keyword_sequence(std::string_view text, const std::vector<std::string>& keywords) {
-        if (keywords.empty() || keywords[0].empty()) return {std::nullopt, std::nullopt};
-
-        std::string_view current_search_origin = text; // The part of text where we are currently looking for keywords[0]
-        size_t total_offset_from_original_text = 0;   // How far current_search_origin is from text.data()
-
-        while (!current_search_origin.empty()) { // Until we run out of text to search
-            // Find the first keyword (keywords[0]) in current_search_origin
-            auto find_kw0_res = find_standalone_substring(current_search_origin, keywords[0]);
-            if (!find_kw0_res) return {std::nullopt, std::nullopt}; // First keyword not found anywhere
-
-            // find_kw0_res.value().second -> start of kw0 within current_search_origin
-            // find_kw0_res.value().first  -> text after kw0 (relative to current_search_origin)
-            size_t kw0_start_in_search_origin = find_kw0_res.value().second;
-            std::string_view after_kw0_in_search_origin = find_kw0_res.value().first;
-            advance_past_whitespace(after_kw0_in_search_origin); // Skip kw0 and its trailing space
-
-            // Text part before the start of the keyword sequence (relative to original 'text')
-            std::string_view text_before_kw0_sequence = text.substr(
-                0, 
-                total_offset_from_original_text + kw0_start_in_search_origin
-            );
-
-            bool sequence_match = true; // Did the entire keyword sequence match?
-            std::string_view current_segment_after_matched_kw = after_kw0_in_search_origin; // Where to look for the next keyword
-
-            // Check the rest of the keywords (from keywords[1] onwards)
-            for (size_t i = 1; i < keywords.size(); ++i) {
-                if (keywords[i].empty()) break; // Empty keyword means end of sequence definition
-
-                // Does current_segment_after_matched_kw start with keywords[i]?
-                if (current_segment_after_matched_kw.rfind(keywords[i], 0) == 0) { 
-                    // Is it a whole word match?
-                    if (current_segment_after_matched_kw.length() == keywords[i].length() || 
-                        std::isspace(static_cast<unsigned char>(current_segment_after_matched_kw[keywords[i].length()]))) {
-                        current_segment_after_matched_kw.remove_prefix(keywords[i].length()); // Skip matched keyword
-                        advance_past_whitespace(current_segment_after_matched_kw); // Skip its trailing space
-                    } else { // Not a whole word
-                        sequence_match = false;
-                        break;
-                    }
-                } else { // Does not start with the keyword
-                    sequence_match = false;
-                    break;
+
+// Compile-time keyword table for the command grammar.
+// Each word with a fixed meaning in the grammar gets its own slot from a perfect hash.
+// The hash coefficients are found at compile time, so classifying a word costs one hash,
+// one table load and one comparison, whichever rule the word starts.
+namespace Grammar {
+
+    enum class Keyword : uint8_t {
+        NONE,
+        GERALT, TOTAL, WHAT, EXIT, STATS,                 // First word of a line
+        LOOTS, TRADES, BREWS, LEARNS, ENCOUNTERS, A,      // After "Geralt"
+        SIGN, POTION, IS, EFFECTIVE, AGAINST, CONSISTS, OF, // "learns" phrases and "What is effective against"
+        IN,                                               // "What is in"
+        CAN, BREW,                                        // "What can Geralt brew?"
+        COUNT
+    };
+
+    constexpr std::string_view KEYWORD_TEXT[] = {
+        "",
+        "Geralt", "Total", "What", "Exit", "Stats?",
+        "loots", "trades", "brews", "learns", "encounters", "a",
+        "sign", "potion", "is", "effective", "against", "consists", "of",
+        "in",
+        "can", "brew"
+    };
+    constexpr size_t KEYWORD_COUNT = static_cast<size_t>(Keyword::COUNT);
+    static_assert(sizeof(KEYWORD_TEXT) / sizeof(KEYWORD_TEXT[0]) == KEYWORD_COUNT, "Every keyword needs its text");
+
+    constexpr size_t TABLE_SIZE = 64;
+
+    // Coefficients of the keyword hash: length, first and last character
+    struct HashSeed {
+        uint32_t length_mul;
+        uint32_t first_mul;
+        uint32_t last_mul;
+        bool valid;
+    };
+
+    constexpr size_t slot_of(std::string_view word, HashSeed seed) {
+        return (word.size() * seed.length_mul +
+                static_cast<unsigned char>(word.front()) * seed.first_mul +
+                static_cast<unsigned char>(word.back()) * seed.last_mul) % TABLE_SIZE;
+    }
+
+    constexpr bool is_collision_free(HashSeed seed) {
+        bool used[TABLE_SIZE] = {};
+        for (size_t k = 1; k < KEYWORD_COUNT; ++k) {
+            size_t slot = slot_of(KEYWORD_TEXT[k], seed);
+            if (used[slot]) return false;
+            used[slot] = true;
+        }
+        return true;
+    }
+
+    // Searches for the first collision-free set of coefficients
+    constexpr HashSeed find_seed() {
+        for (uint32_t length_mul = 0; length_mul < 8; ++length_mul) {
+            for (uint32_t first_mul = 1; first_mul < 32; ++first_mul) {
+                for (uint32_t last_mul = 1; last_mul < 32; ++last_mul) {
+                    HashSeed seed{length_mul, first_mul, last_mul, true};
+                    if (is_collision_free(seed)) return seed;
                 }
             }
+        }
+        return HashSeed{0, 0, 0, false};
+    }
 
-            if (sequence_match) { // Entire sequence matched
-                return {text_before_kw0_sequence, current_segment_after_matched_kw};
-            }
+    constexpr HashSeed SEED = find_seed();
+    static_assert(SEED.valid, "No collision-free hash for the keyword table; grow TABLE_SIZE");
 
-            // First keyword was found, but the rest of the sequence didn't match.
-            // Advance search origin in the original 'text' to look for keywords[0] again.
-            size_t advance_in_search_origin = kw0_start_in_search_origin + 1;
-            if (advance_in_search_origin >= current_search_origin.length()) break; // Nothing left to advance into
-            current_search_origin.remove_prefix(advance_in_search_origin);
-            total_offset_from_original_text += advance_in_search_origin;
+    constexpr std::array<Keyword, TABLE_SIZE> build_table() {
+        std::array<Keyword, TABLE_SIZE> table{};
+        for (size_t k = 1; k < KEYWORD_COUNT; ++k) {
+            table[slot_of(KEYWORD_TEXT[k], SEED)] = static_cast<Keyword>(k);
         }
-        return {std::nullopt, std::nullopt}; // Sequence not found
+        return table;
     }
-} // namespace ParserUtils
+
+    constexpr std::array<Keyword, TABLE_SIZE> TABLE = build_table();
+
+    using AsciiScan::is_space;
+
+    // Classifies a single whitespace-free word
+    inline Keyword classify(std::string_view word) {
+        if (word.empty()) return Keyword::NONE;
+        Keyword candidate = TABLE[slot_of(word, SEED)];
+        return KEYWORD_TEXT[static_cast<size_t>(candidate)] == word ? candidate : Keyword::NONE;
+    }
+
+    // Splits the next word off the front of `text` and skips the whitespace that follows it.
+    // `text` must not start with whitespace.
+    inline std::string_view next_word(std::string_view& text) {
+        size_t end = 0;
+        while (end < text.size() && !is_space(text[end])) ++end;
+        std::string_view word = text.substr(0, end);
+        while (end < text.size() && is_space(text[end])) ++end;
+        text.remove_prefix(end);
+        return word;
+    }
+
+    // Splits the last word off the end of `text` and drops the whitespace before it.
+    // `text` must not end with whitespace.
+    inline std::string_view last_word(std::string_view& text) {
+        size_t start = text.size();
+        while (start > 0 && !is_space(text[start - 1])) --start;
+        std::string_view word = text.substr(start);
+        while (start > 0 && is_space(text[start - 1])) --start;
+        text = text.substr(0, start);
+        return word;
+    }
+
+    // Checks that the words at the start of `text` are exactly `expected`.
+    // On success `after` is set to the text following them (whitespace skipped).
+    inline bool match_words(std::string_view text, std::initializer_list<Keyword> expected, std::string_view& after) {
+        for (Keyword keyword : expected) {
+            if (classify(next_word(text)) != keyword) return false;
+        }
+        after = text;
+        return true;
+    }
+
+    // The text around a "learns" phrase: the item before it and the remainder after it
+    struct PhraseMatch {
+        std::string_view before;
+        std::string_view after;
+    };
+
+    // First occurrence of each phrase a "Geralt learns" line can contain
+    struct LearnPhrases {
+        std::optional<PhraseMatch> sign_effective;   // "<Sign> sign is effective against <Monster>"
+        std::optional<PhraseMatch> potion_effective; // "<Potion> potion is effective against <Monster>"
+        std::optional<PhraseMatch> potion_formula;   // "<Potion> potion consists of <list>"
+    };
+
+    // Finds all three phrases in one left-to-right pass over the words of `body`.
+    // `body` must not start with whitespace.
+    inline LearnPhrases scan_learn_phrases(std::string_view body) {
+        LearnPhrases phrases;
+        std::string_view cursor = body;
+        while (!cursor.empty()) {
+            std::string_view before = body.substr(0, static_cast<size_t>(cursor.data() - body.data()));
+            std::string_view rest = cursor;
+            Keyword word = classify(next_word(rest));
+            std::string_view after;
+            if (word == Keyword::SIGN) {
+                if (match_words(rest, {Keyword::IS, Keyword::EFFECTIVE, Keyword::AGAINST}, after)) {
+                    phrases.sign_effective = PhraseMatch{before, after};
+                    break; // Sign phrases take precedence over anything else on the line
+                }
+            } else if (word == Keyword::POTION) {
+                if (!phrases.potion_effective &&
+                    match_words(rest, {Keyword::IS, Keyword::EFFECTIVE, Keyword::AGAINST}, after)) {
+                    phrases.potion_effective = PhraseMatch{before, after};
+                } else if (!phrases.potion_formula &&
+                           match_words(rest, {Keyword::CONSISTS, Keyword::OF}, after)) {
+                    phrases.potion_formula = PhraseMatch{before, after};
+                }
+            }
+            cursor = rest;
+        }
+        return phrases;
+    }
+} // namespace Grammar
 
 
-// This function takes a raw command line string and attempts to parse it into a Parsed::Command object.
-Parsed::Command parse_command_internal(const std::string& original_line) {
+// This function takes a raw command line and attempts to parse it into a Parsed::Command object.
+// The first one or two words select the rule through Grammar's keyword table.
+// The payload views point into `original_line`, and item lists are placed in `arena`;
+// both must outlive the returned command.
+Parsed::Command parse_command_internal(std::string_view original_line, LineArena& arena) {
     using namespace ParserUtils;
+    using Grammar::Keyword;
 
     Parsed::Command result; // Default initialized to INVALID
-    std::string line_trimmed_str = trim_whitespace_str(original_line); // Make a trimmed copy
-    std::string_view line_view(line_trimmed_str); // Work with a view for efficiency
+    std::string_view p = trim_whitespace(original_line); // 'p' is our current parsing cursor (a string_view)
 
-    if (line_view.empty()) {
+    if (p.empty()) {
         result.type = CommandType::EMPTY;
         return result;
     }
 
-    if (line_view == "Exit") {
-        result.type = CommandType::EXIT;
+    switch (Grammar::classify(Grammar::next_word(p))) {
+    case Keyword::EXIT:
+        if (p.empty()) { // Only a bare "Exit" line leaves the game
+            result.type = CommandType::EXIT;
+        }
+        return result;
+
+    // Stats?
+    case Keyword::STATS:
+        if (p.empty()) {
+            result.type = CommandType::QUERY_STATS;
+        }
         return result;
-    }
-    
-    std::string_view p = line_view; // 'p' is our current parsing cursor (a string_view)
 
-    // Check if the command starts with "Geralt"
-    if (match_and_advance(p, "Geralt")) {
-        std::string_view p_after_geralt = p; // Save state after "Geralt"
+    case Keyword::GERALT:
+        switch (Grammar::classify(Grammar::next_word(p))) {
 
         // Geralt loots ...
-        if (match_and_advance(p, "loots")) {
-            auto items_opt = parse_item_list(std::string(p), false); // Looted item names don't have spaces
+        case Keyword::LOOTS: {
+            auto items_opt = parse_item_list(p, false, arena); // Looted item names don't have spaces
             if (items_opt && !items_opt.value().empty()) { // Successfully parsed a non-empty list
                 result.type = CommandType::LOOT;
                 result.data = Parsed::LootPayload{items_opt.value()};
             }
             return result; // Return, valid or invalid
         }
-        p = p_after_geralt; // Reset for next "Geralt" command check
 
         // Geralt trades ... trophy for ...
-        if (match_and_advance(p, "trades")) {
+        case Keyword::TRADES: {
             std::string_view trade_content_view = p; // The part after "Geralt trades "
             // Find "trophy" then "for"
             auto trophy_kw_search_result = find_standalone_substring(trade_content_view, "trophy");
-            
+
             if (trophy_kw_search_result) {
                 size_t trophy_kw_start_offset = trophy_kw_search_result.value().second; // Where "trophy" starts
                 std::string_view before_trophy_sv = trade_content_view.substr(0, trophy_kw_start_offset); // Text before "trophy"
                 std::string_view after_trophy_kw_sv_temp = trophy_kw_search_result.value().first; // Text after "trophy"
                 advance_past_whitespace(after_trophy_kw_sv_temp); // Skip space after "trophy "
 
-                std::string temp_before_trophy_str = std::string(before_trophy_sv);
-                trim_whitespace_in_place(temp_before_trophy_str);
-                if (temp_before_trophy_str.empty()) return result; // Nothing before "trophy" keyword, invalid
+                std::string_view trophies_sv = trim_whitespace(before_trophy_sv); // Items to give
+                if (trophies_sv.empty()) return result; // Nothing before "trophy" keyword, invalid
 
                 auto for_kw_search_result = find_standalone_substring(after_trophy_kw_sv_temp, "for");
 
                 if (for_kw_search_result) {
-                    std::string trophies_str = temp_before_trophy_str; // Items to give
                     std::string_view after_for_kw_sv = for_kw_search_result.value().first; // Text after "for"
-                    advance_past_whitespace(after_for_kw_sv); // Skip space after "for "
-                    std::string ingredients_str = std::string(after_for_kw_sv); // Items to receive
+                    advance_past_whitespace(after_for_kw_sv); // Skip space after "for "; the rest is the items to receive
 
-                    auto trophies_opt = parse_item_list(trophies_str, false); // Trophy names no spaces
-                    auto ingredients_opt = parse_item_list(ingredients_str, false); // Ingredient names no spaces
+                    auto trophies_opt = parse_item_list(trophies_sv, false, arena); // Trophy names no spaces
+                    auto ingredients_opt = parse_item_list(after_for_kw_sv, false, arena); // Ingredient names no spaces
 
                     if (trophies_opt && !trophies_opt.value().empty() &&
                         ingredients_opt && !ingredients_opt.value().empty()) {
@@ -502,37 +978,43 @@ Parsed::Command parse_command_internal(const std::string& original_line) {
             }
             return result;
         }
-        p = p_after_geralt;
 
         // Geralt brews Potion Name
-        if (match_and_advance(p, "brews")) {
-            // For "brews", the rest of the line is considered the potion name.
-            std::string potion_name_str = std::string(p);
-            trim_whitespace_in_place(potion_name_str);
-            auto potion_name_opt = parse_name(potion_name_str, true); // Potion names can have spaces
+        case Keyword::BREWS: {
+            // For "brews", the rest of the line is considered the potion name, optionally
+            // preceded by a batch count: "Geralt brews 3 Swallow" or "Geralt brews * Swallow".
+            // Potion names never contain digits or '*', so the two forms cannot be confused.
+            Parsed::BrewPayload payload;
+            std::string_view name_view = p;
+            if (!p.empty() && (p[0] == '*' || p[0] == '+' || (p[0] >= '0' && p[0] <= '9'))) {
+                std::string_view count_word = Grammar::next_word(name_view);
+                if (count_word == "*") {
+                    payload.count = Parsed::BREW_AS_MANY_AS_POSSIBLE;
+                } else {
+                    auto count_opt = parse_quantity(count_word);
+                    if (!count_opt) return result;
+                    payload.count = count_opt.value();
+                }
+                payload.batch = true;
+            }
+            auto potion_name_opt = parse_name(name_view, true); // Potion names can have spaces
 
             if (potion_name_opt && !potion_name_opt.value().empty()) {
+                 payload.potion_name = potion_name_opt.value();
                  result.type = CommandType::BREW;
-                 result.data = Parsed::BrewPayload{potion_name_opt.value()};
+                 result.data = payload;
             }
             return result;
         }
-        p = p_after_geralt;
 
         // Geralt learns ...
-        if (match_and_advance(p, "learns")) {
-            std::string_view learn_content_start = p; // Text after "Geralt learns "
-            
-            // Geralt learns SignName sign is effective against MonsterName
-            auto seq_res_sign = find_keyword_sequence(learn_content_start, {"sign", "is", "effective", "against"});
-            if (seq_res_sign.first && seq_res_sign.second) { // Sequence found
-                std::string item_name_str = std::string(seq_res_sign.first.value()); // Text before "sign..."
-                trim_whitespace_in_place(item_name_str);
-                std::string monster_name_str = std::string(seq_res_sign.second.value()); // Text after "...against "
-                trim_whitespace_in_place(monster_name_str);
+        case Keyword::LEARNS: {
+            Grammar::LearnPhrases phrases = Grammar::scan_learn_phrases(p); // Text after "Geralt learns "
 
-                auto item_name_opt = parse_name(item_name_str, false); // Sign names are single words
-                auto monster_name_opt = parse_name(monster_name_str, false); // Monster names are single words
+            // Geralt learns SignName sign is effective against MonsterName
+            if (phrases.sign_effective) {
+                auto item_name_opt = parse_name(phrases.sign_effective->before, false); // Sign names are single words
+                auto monster_name_opt = parse_name(phrases.sign_effective->after, false); // Monster names are single words
 
                 if (item_name_opt && monster_name_opt && !item_name_opt.value().empty() && !monster_name_opt.value().empty()) {
                     result.type = CommandType::LEARN_EFFECTIVENESS;
@@ -542,15 +1024,9 @@ Parsed::Command parse_command_internal(const std::string& original_line) {
             }
 
             // Geralt learns Potion Name potion is effective against MonsterName
-            auto seq_res_potion_eff = find_keyword_sequence(learn_content_start, {"potion", "is", "effective", "against"});
-            if (seq_res_potion_eff.first && seq_res_potion_eff.second) {
-                std::string item_name_str = std::string(seq_res_potion_eff.first.value());
-                trim_whitespace_in_place(item_name_str);
-                std::string monster_name_str = std::string(seq_res_potion_eff.second.value());
-                trim_whitespace_in_place(monster_name_str);
-
-                auto item_name_opt = parse_name(item_name_str, true); // Potion names can have spaces
-                auto monster_name_opt = parse_name(monster_name_str, false);
+            if (phrases.potion_effective) {
+                auto item_name_opt = parse_name(phrases.potion_effective->before, true); // Potion names can have spaces
+                auto monster_name_opt = parse_name(phrases.potion_effective->after, false);
 
                 if (item_name_opt && monster_name_opt && !item_name_opt.value().empty() && !monster_name_opt.value().empty()) {
                     result.type = CommandType::LEARN_EFFECTIVENESS;
@@ -558,19 +1034,14 @@ Parsed::Command parse_command_internal(const std::string& original_line) {
                 }
                 return result;
             }
-            
+
             // Geralt learns Potion Name potion consists of Ing1, Ing2...
-            auto seq_res_potion_formula = find_keyword_sequence(learn_content_start, {"potion", "consists", "of"});
-             if (seq_res_potion_formula.first && seq_res_potion_formula.second) {
-                std::string potion_name_str = std::string(seq_res_potion_formula.first.value());
-                trim_whitespace_in_place(potion_name_str);
-                std::string ingredients_list_str = std::string(seq_res_potion_formula.second.value()); // Text after "...of "
-                
-                auto potion_name_opt = parse_name(potion_name_str, true); // Potion names allow spaces
-                auto ingredients_opt = parse_item_list(ingredients_list_str, false); // Ingredient names no spaces
-
-                if (potion_name_opt && ingredients_opt && !potion_name_opt.value().empty() && 
-                    ingredients_opt.has_value() && !ingredients_opt.value().empty()) { // Check ingredients_opt has value and is not empty
+            if (phrases.potion_formula) {
+                auto potion_name_opt = parse_name(phrases.potion_formula->before, true); // Potion names allow spaces
+                auto ingredients_opt = parse_item_list(phrases.potion_formula->after, false, arena); // Ingredient names no spaces
+
+                if (potion_name_opt && ingredients_opt && !potion_name_opt.value().empty() &&
+                    !ingredients_opt.value().empty()) {
                     result.type = CommandType::LEARN_FORMULA;
                     result.data = Parsed::LearnFormulaPayload{potion_name_opt.value(), ingredients_opt.value()};
                 }
@@ -578,320 +1049,849 @@ Parsed::Command parse_command_internal(const std::string& original_line) {
             }
             return result; // No "learns" pattern matched
         }
-        p = p_after_geralt; // Reset if "learns" not matched
 
         // Geralt encounters a MonsterName
-        if (match_and_advance(p, "encounters")) {
-            if (match_and_advance(p, "a")) { // Must have "a"
-                std::string monster_name_str = std::string(p); // Rest of the line is monster name
-                trim_whitespace_in_place(monster_name_str);
-                auto monster_name_opt = parse_name(monster_name_str, false); // Monster name single word
+        case Keyword::ENCOUNTERS:
+            if (Grammar::classify(Grammar::next_word(p)) == Keyword::A) { // Must have "a"
+                auto monster_name_opt = parse_name(p, false); // Rest of the line is monster name, single word
                 if (monster_name_opt && !monster_name_opt.value().empty()) {
                     result.type = CommandType::ENCOUNTER;
                     result.data = Parsed::EncounterPayload{monster_name_opt.value()};
                 }
             }
             return result;
-        }
-        return result; // Unrecognized command after "Geralt"
-    }
-    p = line_view; // Reset to beginning of line if not a "Geralt" command
 
+        default:
+            return result; // Unrecognized command after "Geralt"
+        }
 
     // --- Query Commands ---
     // Total category [Item Name]?
-    if (match_and_advance(p, "Total")) {
+    case Keyword::TOTAL: {
         std::string_view query_body = p; // Text after "Total "
         if (!query_body.empty() && query_body.back() == '?') { // Must end with '?'
             query_body.remove_suffix(1); // Remove '?'
-            
-            std::string query_content_str = std::string(query_body); // Make a mutable copy
-            trim_whitespace_in_place(query_content_str);
 
-            if (query_content_str.empty()) return result; // "Total ?" is invalid
+            std::string_view query_content = trim_whitespace(query_body);
 
-            size_t first_space = query_content_str.find(' ');
-            std::string category_str;
-            std::string item_name_str_query; // Renamed to avoid conflict with other item_name_str
+            if (query_content.empty()) return result; // "Total ?" is invalid
 
-            if (first_space == std::string::npos) { // Only category, e.g., "Total ingredient?"
-                category_str = query_content_str;
+            size_t first_space = query_content.find(' ');
+            std::string_view category_sv;
+            std::string_view item_name_query;
+
+            if (first_space == std::string_view::npos) { // Only category, e.g., "Total ingredient?"
+                category_sv = query_content;
             } else { // Category and item name, e.g., "Total potion Healing Potion?"
-                category_str = query_content_str.substr(0, first_space);
-                item_name_str_query = query_content_str.substr(first_space + 1);
-                trim_whitespace_in_place(item_name_str_query);
+                category_sv = query_content.substr(0, first_space);
+                item_name_query = trim_whitespace(query_content.substr(first_space + 1));
             }
-            trim_whitespace_in_place(category_str);
+            trim_whitespace_in_place(category_sv);
 
-            if (category_str != "ingredient" && category_str != "potion" && category_str != "trophy") {
+            if (category_sv != "ingredient" && category_sv != "potion" && category_sv != "trophy") {
                 return result; // Invalid category
             }
 
-            if (!item_name_str_query.empty()) { // Query for a specific item
-                bool name_allows_spaces = (category_str == "potion");
-                auto item_name_opt = parse_name(item_name_str_query, name_allows_spaces);
+            if (!item_name_query.empty()) { // Query for a specific item
+                bool name_allows_spaces = (category_sv == "potion");
+                auto item_name_opt = parse_name(item_name_query, name_allows_spaces);
                 if (item_name_opt && !item_name_opt.value().empty()) {
                     result.type = CommandType::QUERY_TOTAL_SPECIFIC;
-                    result.data = Parsed::QueryTotalSpecificPayload{category_str, item_name_opt.value()};
+                    result.data = Parsed::QueryTotalSpecificPayload{category_sv, item_name_opt.value()};
                 }
             } else { // Query for all items in a category
-                 if (!category_str.empty()){ // Category must exist
+                 if (!category_sv.empty()){ // Category must exist
                     result.type = CommandType::QUERY_TOTAL_ALL;
-                    result.data = Parsed::QueryTotalAllPayload{category_str};
+                    result.data = Parsed::QueryTotalAllPayload{category_sv};
                  }
             }
         }
         return result;
     }
-    p = line_view; // Reset
 
     // What is ...?
-    if (match_and_advance(p, "What")) {
-        if (match_and_advance(p, "is")) {
-            std::string_view p_after_what_is = p; // Save state after "What is "
-
-            // What is effective against MonsterName?
-            if (match_and_advance(p, "effective")) {
-                if (match_and_advance(p, "against")) {
-                    std::string_view monster_segment = p; // Text after "...against "
-                     if (!monster_segment.empty() && monster_segment.back() == '?') {
-                        monster_segment.remove_suffix(1);
-                        std::string monster_name_str = std::string(monster_segment);
-                        trim_whitespace_in_place(monster_name_str);
-                        auto monster_name_opt = parse_name(monster_name_str, false); // Monster name single word
-                        if (monster_name_opt && !monster_name_opt.value().empty()) {
-                            result.type = CommandType::QUERY_EFFECTIVE_AGAINST;
-                            result.data = Parsed::QueryEffectiveAgainstPayload{monster_name_opt.value()};
-                        }
+    case Keyword::WHAT: {
+        switch (Grammar::classify(Grammar::next_word(p))) {
+        case Keyword::IS:
+            break; // Handled below
+
+        // What can Geralt brew?
+        case Keyword::CAN:
+            if (!p.empty() && p.back() == '?') {
+                std::string_view question = trim_whitespace(p.substr(0, p.size() - 1));
+                std::string_view after;
+                if (Grammar::match_words(question, {Keyword::GERALT, Keyword::BREW}, after) && after.empty()) {
+                    result.type = CommandType::QUERY_WHAT_CAN_BREW;
+                }
+            }
+            return result;
+
+        default:
+            return result; // Unrecognized after "What"
+        }
+        std::string_view after_is = p; // Text after "What is ", for the item form below
+        switch (Grammar::classify(Grammar::next_word(p))) {
+
+        // What is effective against MonsterName?
+        case Keyword::EFFECTIVE:
+            if (Grammar::classify(Grammar::next_word(p)) == Keyword::AGAINST) {
+                std::string_view monster_segment = p; // Text after "...against "
+                if (!monster_segment.empty() && monster_segment.back() == '?') {
+                    monster_segment.remove_suffix(1);
+                    auto monster_name_opt = parse_name(monster_segment, false); // Monster name single word
+                    if (monster_name_opt && !monster_name_opt.value().empty()) {
+                        result.type = CommandType::QUERY_EFFECTIVE_AGAINST;
+                        result.data = Parsed::QueryEffectiveAgainstPayload{monster_name_opt.value()};
                     }
-                    return result;
                 }
             }
-            p = p_after_what_is; // Reset to after "What is "
+            return result;
 
-            // What is in Potion Name?
-            if (match_and_advance(p, "in")) {
-                std::string_view potion_segment = p; // Text after "...in "
-                if (!potion_segment.empty() && potion_segment.back() == '?') {
-                    potion_segment.remove_suffix(1);
-                    std::string potion_name_str = std::string(potion_segment);
-                    trim_whitespace_in_place(potion_name_str);
-                    auto potion_name_opt = parse_name(potion_name_str, true); // Potion names allow spaces
-                    if (potion_name_opt && !potion_name_opt.value().empty()) {
-                        result.type = CommandType::QUERY_WHAT_IS_IN;
-                        result.data = Parsed::QueryWhatIsInPayload{potion_name_opt.value()};
+        // What is in Potion Name?
+        case Keyword::IN: {
+            std::string_view potion_segment = p; // Text after "...in "
+            if (!potion_segment.empty() && potion_segment.back() == '?') {
+                potion_segment.remove_suffix(1);
+                auto potion_name_opt = parse_name(potion_segment, true); // Potion names allow spaces
+                if (potion_name_opt && !potion_name_opt.value().empty()) {
+                    result.type = CommandType::QUERY_WHAT_IS_IN;
+                    result.data = Parsed::QueryWhatIsInPayload{potion_name_opt.value()};
+                }
+            }
+            return result;
+        }
+
+        // What is Item Name effective against?
+        default:
+            if (!after_is.empty() && after_is.back() == '?') {
+                std::string_view item_segment = trim_whitespace(after_is.substr(0, after_is.size() - 1));
+                if (Grammar::classify(Grammar::last_word(item_segment)) == Keyword::AGAINST &&
+                    Grammar::classify(Grammar::last_word(item_segment)) == Keyword::EFFECTIVE) {
+                    auto item_name_opt = parse_name(item_segment, true); // Potion names allow spaces
+                    if (item_name_opt && !item_name_opt.value().empty()) {
+                        result.type = CommandType::QUERY_ITEM_EFFECTIVE_AGAINST;
+                        result.data = Parsed::QueryItemEffectiveAgainstPayload{item_name_opt.value()};
                     }
                 }
-                return result;
             }
-             return result; // Unrecognized after "What is"
+            return result;
         }
-         return result; // Unrecognized after "What"
     }
 
-    return result; // Default: INVALID if no pattern matched
+    default:
+        return result; // Default: INVALID if no pattern matched
+    }
 }
 
 
 // These classes represent the game's state and logic.
 
-class InventoryItem {
-public:
-    std::string name;
-    int quantity;
-
-    InventoryItem(std::string n, int q) : name(std::move(n)), quantity(q) {}
+// Compact handle for an interned name
+using SymbolId = uint32_t;
+const SymbolId INVALID_SYMBOL = UINT32_MAX; // Returned by SymbolTable::find for names never interned
 
-    static bool compareByName(const InventoryItem& a, const InventoryItem& b) {
-        return a.name < b.name;
-    }
-};
+// Interns every distinct name once. The game stores and compares SymbolIds everywhere
+// and turns them back into text only when printing.
+class SymbolTable {
+private:
+    LineArena storage_;                    // Name bytes; never reset, so the views below stay valid
+    std::vector<std::string_view> names_;  // Indexed by SymbolId
+    std::unordered_map<std::string_view, SymbolId> ids_;
 
-class IngredientRequirement {
 public:
-    std::string ingredient_name;
-    int quantity;
-
-    IngredientRequirement(std::string name, int q) : ingredient_name(std::move(name)), quantity(q) {}
-
-    // Custom comparison for sorting formula requirements
-    static bool compareForFormula(const IngredientRequirement& a, const IngredientRequirement& b) {
-        if (a.quantity != b.quantity) {
-            return a.quantity > b.quantity; // Descending by quantity
+    SymbolTable() = default;
+    SymbolTable(const SymbolTable&) = delete;
+    SymbolTable& operator=(const SymbolTable&) = delete;
+
+    // Returns the ID of `name`, assigning a new one the first time the name is seen
+    SymbolId intern(std::string_view name) {
+        auto it = ids_.find(name);
+        if (it != ids_.end()) {
+            return it->second;
         }
-        return a.ingredient_name < b.ingredient_name; // Ascending by name
+        std::string_view stored = storage_.copy(name);
+        SymbolId id = static_cast<SymbolId>(names_.size());
+        names_.push_back(stored);
+        ids_.emplace(stored, id);
+        return id;
     }
-};
 
-class EffectiveItem {
-public:
-    std::string name;
-    EffectivenessType type;
+    // Assigns the next ID to `name` without copying it; the caller keeps the bytes alive
+    // for the table's lifetime. Returns false if the name is already known.
+    bool adopt(std::string_view name) {
+        if (!ids_.emplace(name, static_cast<SymbolId>(names_.size())).second) return false;
+        names_.push_back(name);
+        return true;
+    }
 
-    EffectiveItem(std::string n, EffectivenessType t) : name(std::move(n)), type(t) {}
+    // Returns the ID of `name`, or INVALID_SYMBOL if it was never interned
+    SymbolId find(std::string_view name) const {
+        auto it = ids_.find(name);
+        return it != ids_.end() ? it->second : INVALID_SYMBOL;
+    }
 
-    static bool compareByName(const EffectiveItem& a, const EffectiveItem& b) {
-        return a.name < b.name;
+    std::string_view name(SymbolId id) const {
+        return names_[id];
     }
+
+    size_t size() const { return names_.size(); }
 };
 
-// Manages Geralt's ingredients, potions, and trophies
-class Inventory {
+// Open-addressing hash map keyed by SymbolId, using linear probing in one flat array.
+// No per-entry allocation; entries are never erased (the game never forgets a name).
+template <typename Value>
+class FlatSymbolMap {
 private:
-    std::vector<InventoryItem> ingredients_;
-    std::vector<InventoryItem> potions_;
-    std::vector<InventoryItem> trophies_;
+    struct Slot {
+        SymbolId key = INVALID_SYMBOL; // INVALID_SYMBOL marks an empty slot
+        Value value{};
+    };
 
-    // Helper to find an item in a given item list
-    InventoryItem* findItemInternal(std::vector<InventoryItem>& items, const std::string& name) {
-        for (auto& item : items) {
-            if (item.name == name) {
-                return &item;
-            }
-        }
-        return nullptr;
+    std::vector<Slot> slots_;
+    size_t size_ = 0;
+    unsigned shift_ = 64; // 64 - log2(capacity), for Fibonacci hashing
+
+    size_t home(SymbolId key) const {
+        return static_cast<size_t>((static_cast<uint64_t>(key) * 0x9E3779B97F4A7C15ULL) >> shift_);
     }
-    // Const version of findItemInternal
-    const InventoryItem* findItemInternal(const std::vector<InventoryItem>& items, const std::string& name) const {
-        for (const auto& item : items) {
-            if (item.name == name) {
-                return &item;
+
+    void grow() {
+        std::vector<Slot> old_slots = std::move(slots_);
+        size_t capacity = old_slots.empty() ? 16 : old_slots.size() * 2;
+        slots_.assign(capacity, Slot{});
+        shift_ = 64;
+        for (size_t c = capacity; c > 1; c >>= 1) --shift_;
+        for (const Slot& slot : old_slots) {
+            if (slot.key != INVALID_SYMBOL) {
+                slots_[probe(slot.key)] = slot;
             }
         }
-        return nullptr;
     }
 
-    // Adds or updates an item's quantity in a list. If quantity becomes < 0, it's set to 0.
-    void addOrUpdateItemInternal(std::vector<InventoryItem>& items, const std::string& name, int quantity_change) {
-        InventoryItem* item = findItemInternal(items, name);
-        if (item) {
-            item->quantity += quantity_change;
-            if (item->quantity < 0) item->quantity = 0; // Prevent negative quantities
-        } else {
-            if (quantity_change > 0 && items.size() < GameConstants::MAX_ITEMS) { // Only add if new and positive quantity
-                items.emplace_back(name, quantity_change);
-            }
+    // Index of the slot holding `key`, or of the empty slot where it would go
+    size_t probe(SymbolId key) const {
+        size_t mask = slots_.size() - 1;
+        size_t i = home(key);
+        while (slots_[i].key != INVALID_SYMBOL && slots_[i].key != key) {
+            i = (i + 1) & mask;
         }
+        return i;
     }
 
-    int getItemQuantityInternal(const std::vector<InventoryItem>& items, const std::string& name) const {
-        const InventoryItem* item = findItemInternal(items, name);
-        return item ? item->quantity : 0;
+public:
+    Value* find(SymbolId key) {
+        if (slots_.empty() || key == INVALID_SYMBOL) return nullptr;
+        Slot& slot = slots_[probe(key)];
+        return slot.key == key ? &slot.value : nullptr;
     }
 
-    // Tries to use (decrement) an item's quantity. Returns true if successful.
-    bool useItemInternal(std::vector<InventoryItem>& items, const std::string& name, int quantity_to_use) {
-        if (quantity_to_use <= 0) return false;
-        InventoryItem* item = findItemInternal(items, name);
-        if (item && item->quantity >= quantity_to_use) {
-            item->quantity -= quantity_to_use;
-            return true;
-        }
-        return false;
+    const Value* find(SymbolId key) const {
+        return const_cast<FlatSymbolMap*>(this)->find(key);
     }
 
-    // Prints all items (with quantity > 0) from a list, sorted by name.
-    void printAllItemsInternal(const std::vector<InventoryItem>& items_const, const std::string& none_message) const {
-        std::vector<InventoryItem> items_to_print;
-        for (const auto& item : items_const) {
-            if (item.quantity > 0) {
-                items_to_print.push_back(item);
-            }
-        }
-
-        if (items_to_print.empty()) {
-            std::cout << none_message << std::endl;
-            return;
-        }
-        std::sort(items_to_print.begin(), items_to_print.end(), InventoryItem::compareByName);
-        for (size_t i = 0; i < items_to_print.size(); ++i) {
-            if (i > 0) {
-                std::cout << ", ";
-            }
-            std::cout << items_to_print[i].quantity << " " << items_to_print[i].name;
+    // Inserts `value` under a key that is not yet present
+    void insert(SymbolId key, Value value) {
+        if ((size_ + 1) * 4 > slots_.size() * 3) { // Keep the load factor at or below 3/4
+            grow();
         }
-        std::cout << std::endl;
+        Slot& slot = slots_[probe(key)];
+        slot.key = key;
+        slot.value = value;
+        ++size_;
     }
 
-public:
-    // Public interface for ingredients
-    void addIngredient(const std::string& name, int quantity) { addOrUpdateItemInternal(ingredients_, name, quantity); }
-    int getIngredientQuantity(const std::string& name) const { return getItemQuantityInternal(ingredients_, name); }
-    bool useIngredient(const std::string& name, int quantity) { return useItemInternal(ingredients_, name, quantity); }
-    void printAllIngredients() const { printAllItemsInternal(ingredients_, "None"); }
-
-    // Public interface for potions
-    void addPotion(const std::string& name, int quantity) { addOrUpdateItemInternal(potions_, name, quantity); }
-    int getPotionQuantity(const std::string& name) const { return getItemQuantityInternal(potions_, name); }
-    bool usePotion(const std::string& name, int quantity) { return useItemInternal(potions_, name, quantity); }
-    void printAllPotions() const { printAllItemsInternal(potions_, "None"); }
-
-    // Public interface for trophies
-    void addTrophy(const std::string& name, int quantity) { addOrUpdateItemInternal(trophies_, name, quantity); }
-    int getTrophyQuantity(const std::string& name) const { return getItemQuantityInternal(trophies_, name); }
-    bool useTrophy(const std::string& name, int quantity) { return useItemInternal(trophies_, name, quantity); }
-    void printAllTrophies() const { printAllItemsInternal(trophies_, "None"); }
+    size_t size() const { return size_; }
 };
 
-// Represents a single potion formula
-class PotionFormula {
+// Append-only text buffer that all game output goes through in place of iostream.
+// Integers are formatted with std::to_chars, and text is copied verbatim. Where the
+// bytes go depends on the sink:
+// - FD: written to a file descriptor when the buffer fills up or on flush()
+// - MEMORY: kept until the owner takes them
+// - DISCARD: dropped, for benchmarks
+class OutputWriter {
 public:
-    std::string potion_name;
-    std::vector<IngredientRequirement> requirements;
+    enum class Sink { FD, MEMORY, DISCARD };
 
-    PotionFormula(std::string name, std::vector<IngredientRequirement> reqs)
-        : potion_name(std::move(name)), requirements(std::move(reqs)) {}
+private:
+    Sink sink_;
+    int fd_;
+    size_t capacity_; // FD sink: buffered bytes that trigger a write
+    std::string buffer_;
+
+    OutputWriter(Sink sink, int fd, size_t capacity) : sink_(sink), fd_(fd), capacity_(capacity) {
+        if (sink_ == Sink::FD) buffer_.reserve(capacity_);
+    }
+
+    void append(const char* data, size_t length) {
+        if (sink_ == Sink::DISCARD) return;
+        buffer_.append(data, length);
+        if (sink_ == Sink::FD && buffer_.size() >= capacity_) flush();
+    }
+
+public:
+    static OutputWriter toFd(int fd, size_t capacity = GameConstants::OUTPUT_BUFFER_SIZE) {
+        return OutputWriter(Sink::FD, fd, capacity);
+    }
+    static OutputWriter toMemory() { return OutputWriter(Sink::MEMORY, -1, 0); }
+    static OutputWriter discard() { return OutputWriter(Sink::DISCARD, -1, 0); }
+
+    OutputWriter(OutputWriter&& other) noexcept
+        : sink_(other.sink_), fd_(other.fd_), capacity_(other.capacity_), buffer_(std::move(other.buffer_)) {
+        other.sink_ = Sink::DISCARD; // The moved-from writer must not flush again
+    }
+    OutputWriter& operator=(OutputWriter&&) = delete;
+    OutputWriter(const OutputWriter&) = delete;
+    OutputWriter& operator=(const OutputWriter&) = delete;
+
+    ~OutputWriter() { flush(); }
+
+    OutputWriter& operator<<(std::string_view text) {
+        append(text.data(), text.size());
+        return *this;
+    }
+
+    // String literals: length known at compile time
+    template <size_t N>
+    OutputWriter& operator<<(const char (&text)[N]) {
+        append(text, N - 1);
+        return *this;
+    }
+
+    OutputWriter& operator<<(char c) {
+        append(&c, 1);
+        return *this;
+    }
+
+    OutputWriter& operator<<(long long value) {
+        char digits[24];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        append(digits, static_cast<size_t>(result.ptr - digits));
+        return *this;
+    }
+    OutputWriter& operator<<(int value) { return *this << static_cast<long long>(value); }
+
+    // FD sink: writes out everything buffered so far. Other sinks: no effect.
+    void flush() {
+        if (sink_ != Sink::FD || buffer_.empty()) return;
+#if WITCHER_POSIX
+        const char* data = buffer_.data();
+        size_t remaining = buffer_.size();
+        while (remaining > 0) {
+            ssize_t written = write(fd_, data, remaining);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                break; // Output closed (e.g., EPIPE); nothing sensible left to do with it
+            }
+            data += written;
+            remaining -= static_cast<size_t>(written);
+        }
+#else
+        std::fwrite(buffer_.data(), 1, buffer_.size(), fd_ == 2 ? stderr : stdout);
+        std::fflush(fd_ == 2 ? stderr : stdout);
+#endif
+        buffer_.clear();
+    }
+
+    // MEMORY sink: the bytes written so far, and a way to drop them
+    std::string_view contents() const { return buffer_; }
+    void clear() { buffer_.clear(); }
+};
+
+// Fixed response lines, newline included
+namespace Messages {
+    constexpr std::string_view INVALID = "INVALID\n";
+    constexpr std::string_view NONE = "None\n";
+    constexpr std::string_view INGREDIENTS_OBTAINED = "Alchemy ingredients obtained\n";
+    constexpr std::string_view NOT_ENOUGH_TROPHIES = "Not enough trophies\n";
+    constexpr std::string_view TRADE_SUCCESSFUL = "Trade successful\n";
+    constexpr std::string_view NOT_ENOUGH_INGREDIENTS = "Not enough ingredients\n";
+    constexpr std::string_view ALREADY_KNOWN_EFFECTIVENESS = "Already known effectiveness\n";
+    constexpr std::string_view ALREADY_KNOWN_FORMULA = "Already known formula\n";
+    constexpr std::string_view UNPREPARED = "Geralt is unprepared and barely escapes with his life\n";
+    constexpr std::string_view PROMPT = ">> ";
+}
+
+// Append-only object pool whose objects never move. Slots live in fixed-size chunks
+// that are allocated as the pool grows, so pointers, references and slot indices stay
+// valid for the pool's lifetime; holders keep slot indices instead of re-resolving names.
+// Nothing is ever erased (the game never forgets), so every slot below size() is live.
+template <typename T, size_t CHUNK_SIZE = 256>
+class SlabPool {
+private:
+    static_assert((CHUNK_SIZE & (CHUNK_SIZE - 1)) == 0, "CHUNK_SIZE must be a power of two");
+
+    struct Slot {
+        alignas(T) unsigned char storage[sizeof(T)];
+
+        T* object() { return std::launder(reinterpret_cast<T*>(storage)); }
+        const T* object() const { return std::launder(reinterpret_cast<const T*>(storage)); }
+    };
+
+    std::vector<std::unique_ptr<Slot[]>> chunks_;
+    uint32_t slot_count_ = 0;
+
+    Slot& slot(uint32_t index) { return chunks_[index / CHUNK_SIZE][index % CHUNK_SIZE]; }
+    const Slot& slot(uint32_t index) const { return chunks_[index / CHUNK_SIZE][index % CHUNK_SIZE]; }
+
+public:
+    SlabPool() = default;
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    ~SlabPool() {
+        for (uint32_t i = 0; i < slot_count_; ++i) {
+            slot(i).object()->~T();
+        }
+    }
+
+    // Constructs an object in the next slot and returns the slot's index
+    template <typename... Args>
+    uint32_t emplace(Args&&... args) {
+        if (slot_count_ % CHUNK_SIZE == 0) {
+            chunks_.push_back(std::make_unique<Slot[]>(CHUNK_SIZE));
+        }
+        new (slot(slot_count_).storage) T(std::forward<Args>(args)...);
+        return slot_count_++;
+    }
+
+    // Unchecked access by slot index; the index must be below size()
+    T& operator[](uint32_t index) { return *slot(index).object(); }
+    const T& operator[](uint32_t index) const { return *slot(index).object(); }
+
+    uint32_t size() const { return slot_count_; }
+};
+
+class InventoryItem {
+public:
+    SymbolId name;
+    int quantity;
+
+    InventoryItem(SymbolId n, int q) : name(n), quantity(q) {}
+};
+
+class IngredientRequirement {
+public:
+    SymbolId ingredient_name;
+    int quantity;
+
+    IngredientRequirement(SymbolId name, int q) : ingredient_name(name), quantity(q) {}
+
+    // Custom comparison for sorting formula requirements
+    static bool compareForFormula(const SymbolTable& symbols, const IngredientRequirement& a, const IngredientRequirement& b) {
+        if (a.quantity != b.quantity) {
+            return a.quantity > b.quantity; // Descending by quantity
+        }
+        return symbols.name(a.ingredient_name) < symbols.name(b.ingredient_name); // Ascending by name
+    }
+};
+
+// A formula requirement resolved to the ingredient's inventory slot
+struct SlotRequirement {
+    uint32_t slot;
+    int quantity;
+};
+
+class EffectiveItem {
+public:
+    SymbolId name;
+    EffectivenessType type;
+
+    EffectiveItem(SymbolId n, EffectivenessType t) : name(n), type(t) {}
+
+    static bool compareByName(const SymbolTable& symbols, const EffectiveItem& a, const EffectiveItem& b) {
+        return symbols.name(a.name) < symbols.name(b.name);
+    }
+};
+
+// Receives every change to an ingredient's quantity, identified by its inventory slot
+class IngredientObserver {
+public:
+    virtual ~IngredientObserver() = default;
+    virtual void onIngredientChanged(uint32_t slot, int old_quantity, int new_quantity) = 0;
+};
+
+// Index policies for Inventory: how an item is located inside its category's item pool.
+// Both return the item's slot or NOT_FOUND, and are told about every appended item.
+struct LinearScanIndex { // Scans the pool; no extra memory, fine for a handful of items
+    static const uint32_t NOT_FOUND = UINT32_MAX;
+
+    uint32_t lookup(const SlabPool<InventoryItem>& items, SymbolId name) const {
+        for (uint32_t i = 0; i < items.size(); ++i) {
+            if (items[i].name == name) {
+                return i;
+            }
+        }
+        return NOT_FOUND;
+    }
+
+    void onAppend(SymbolId, uint32_t) {}
+};
+
+struct FlatHashIndex { // O(1) lookup through a FlatSymbolMap from name to slot
+    static const uint32_t NOT_FOUND = UINT32_MAX;
+
+    FlatSymbolMap<uint32_t> positions;
+
+    uint32_t lookup(const SlabPool<InventoryItem>&, SymbolId name) const {
+        const uint32_t* position = positions.find(name);
+        return position ? *position : NOT_FOUND;
+    }
+
+    void onAppend(SymbolId name, uint32_t slot) {
+        positions.insert(name, slot);
+    }
+};
+
+// Manages Geralt's ingredients, potions, and trophies.
+// `IndexPolicy` selects how items are looked up (see LinearScanIndex and FlatHashIndex).
+template <typename IndexPolicy>
+class BasicInventory {
+private:
+    // Items of one category, plus the policy's index over them. Items are never erased,
+    // so slots are handed out in first-seen order and stay put.
+    // `in_stock` orders the items with quantity > 0 by name, for the listing queries.
+    struct Category {
+        SlabPool<InventoryItem> items;
+        IndexPolicy index;
+        std::map<std::string_view, uint32_t> in_stock; // Name -> slot in `items`
+    };
+
+    const SymbolTable& symbols_; // Resolves item names for printing
+    IngredientObserver* ingredient_observer_ = nullptr;
+    std::mutex in_stock_mutex_; // Guards every category's in_stock during parallel apply
+    Category ingredients_;
+    Category potions_;
+    Category trophies_;
+
+    // Helper to find an item's slot in a given category, or IndexPolicy::NOT_FOUND
+    uint32_t findSlotInternal(const Category& category, SymbolId name) const {
+        return category.index.lookup(category.items, name);
+    }
+
+    // Stores a new quantity for an existing item, keeping `in_stock` in step when it
+    // crosses between zero and positive, and reports ingredient changes to the observer
+    void setQuantityInternal(Category& category, uint32_t slot, int quantity) {
+        InventoryItem& item = category.items[slot];
+        int old_quantity = item.quantity;
+        bool was_in_stock = old_quantity > 0;
+        item.quantity = quantity;
+        if (ingredient_observer_ && &category == &ingredients_ && old_quantity != quantity) {
+            ingredient_observer_->onIngredientChanged(slot, old_quantity, quantity);
+        }
+        if (was_in_stock == (quantity > 0)) return;
+        std::lock_guard<std::mutex> lock(in_stock_mutex_);
+        if (quantity > 0) {
+            category.in_stock.emplace(symbols_.name(item.name), slot);
+        } else {
+            category.in_stock.erase(symbols_.name(item.name));
+        }
+    }
+
+    // Adds or updates an item's quantity in a category. If quantity becomes < 0, it's set to 0.
+    void addOrUpdateItemInternal(Category& category, SymbolId name, int quantity_change) {
+        uint32_t slot = findSlotInternal(category, name);
+        if (slot != IndexPolicy::NOT_FOUND) {
+            int quantity = category.items[slot].quantity + quantity_change;
+            if (quantity < 0) quantity = 0; // Prevent negative quantities
+            setQuantityInternal(category, slot, quantity);
+        } else {
+            if (quantity_change > 0) { // Only add if new and positive quantity
+                setQuantityInternal(category, appendSlotInternal(category, name), quantity_change);
+            }
+        }
+    }
+
+    // Appends a new item with quantity 0 (which keeps it out of listings) and returns its slot
+    uint32_t appendSlotInternal(Category& category, SymbolId name) {
+        uint32_t slot = category.items.emplace(name, 0);
+        category.index.onAppend(name, slot);
+        return slot;
+    }
+
+    // Slot of the item in its category, appending it with quantity 0 if it is new
+    uint32_t reserveSlotInternal(Category& category, SymbolId name) {
+        uint32_t slot = findSlotInternal(category, name);
+        return slot != IndexPolicy::NOT_FOUND ? slot : appendSlotInternal(category, name);
+    }
+
+    bool restoreItemInternal(Category& category, SymbolId name, int quantity) {
+        if (findSlotInternal(category, name) != IndexPolicy::NOT_FOUND) return false;
+        setQuantityInternal(category, appendSlotInternal(category, name), quantity);
+        return true;
+    }
+
+    int getItemQuantityInternal(const Category& category, SymbolId name) const {
+        uint32_t slot = findSlotInternal(category, name);
+        return slot != IndexPolicy::NOT_FOUND ? category.items[slot].quantity : 0;
+    }
+
+    // Tries to use (decrement) an item's quantity at a slot. Returns true if successful.
+    bool useSlotInternal(Category& category, uint32_t slot, int quantity_to_use) {
+        if (quantity_to_use <= 0 || slot == IndexPolicy::NOT_FOUND) return false;
+        int quantity = category.items[slot].quantity;
+        if (quantity < quantity_to_use) return false;
+        setQuantityInternal(category, slot, quantity - quantity_to_use);
+        return true;
+    }
+
+    // Tries to use (decrement) an item's quantity. Returns true if successful.
+    bool useItemInternal(Category& category, SymbolId name, int quantity_to_use) {
+        if (quantity_to_use <= 0) return false;
+        return useSlotInternal(category, findSlotInternal(category, name), quantity_to_use);
+    }
+
+    // Prints all items (with quantity > 0) from a category, sorted by name.
+    void printAllItemsInternal(OutputWriter& out, const Category& category, std::string_view none_message) const {
+        if (category.in_stock.empty()) {
+            out << none_message;
+            return;
+        }
+        bool first = true;
+        for (const auto& [name, position] : category.in_stock) {
+            if (!first) {
+                out << ", ";
+            }
+            out << category.items[position].quantity << " " << name;
+            first = false;
+        }
+        out << '\n';
+    }
+
+public:
+    explicit BasicInventory(const SymbolTable& symbols) : symbols_(symbols) {}
+
+    void setIngredientObserver(IngredientObserver* observer) { ingredient_observer_ = observer; }
+
+    int ingredientQuantityAt(uint32_t slot) const { return ingredients_.items[slot].quantity; }
+
+    // Returns the ingredient's slot, creating it with quantity 0 if needed.
+    // Slots never move, so formulas can hold them instead of names.
+    uint32_t reserveIngredientSlot(SymbolId name) { return reserveSlotInternal(ingredients_, name); }
+
+    // True if every requirement is covered on its own (gather-compare over the slots)
+    bool hasIngredients(const std::vector<SlotRequirement>& reqs) const {
+        const SlabPool<InventoryItem>& items = ingredients_.items;
+        bool enough = true;
+        for (const SlotRequirement& req : reqs) {
+            enough &= items[req.slot].quantity >= req.quantity;
+        }
+        return enough;
+    }
+
+    // Number of times `totals` (one entry per distinct slot) can be taken from stock
+    int maxBatches(const std::vector<SlotRequirement>& totals) const {
+        const SlabPool<InventoryItem>& items = ingredients_.items;
+        int batches = INT_MAX;
+        for (const SlotRequirement& req : totals) {
+            batches = std::min(batches, items[req.slot].quantity / req.quantity);
+        }
+        return totals.empty() ? 0 : batches;
+    }
+
+    // Takes `totals` from stock `batches` times in one pass; the caller checked maxBatches
+    void consumeBatches(const std::vector<SlotRequirement>& totals, int batches) {
+        for (const SlotRequirement& req : totals) {
+            setQuantityInternal(ingredients_, req.slot, ingredients_.items[req.slot].quantity - req.quantity * batches);
+        }
+    }
+
+    // Subtracts the requirements in order. Stops and returns false at the first one that
+    // is no longer covered, which only happens when a formula lists an ingredient twice.
+    bool consumeIngredients(const std::vector<SlotRequirement>& reqs) {
+        for (const SlotRequirement& req : reqs) {
+            if (!useSlotInternal(ingredients_, req.slot, req.quantity)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Item pools in slot order, for snapshots
+    const SlabPool<InventoryItem>& ingredientSlots() const { return ingredients_.items; }
+    const SlabPool<InventoryItem>& potionSlots() const { return potions_.items; }
+    const SlabPool<InventoryItem>& trophySlots() const { return trophies_.items; }
+
+    // Appends an item with its saved quantity, in slot order; false if it already has a slot
+    bool restoreIngredient(SymbolId name, int quantity) { return restoreItemInternal(ingredients_, name, quantity); }
+    bool restorePotion(SymbolId name, int quantity) { return restoreItemInternal(potions_, name, quantity); }
+    bool restoreTrophy(SymbolId name, int quantity) { return restoreItemInternal(trophies_, name, quantity); }
+
+    // True if the item has a slot (possibly with quantity 0); adding to it creates nothing
+    bool containsIngredient(SymbolId name) const { return findSlotInternal(ingredients_, name) != IndexPolicy::NOT_FOUND; }
+    bool containsPotion(SymbolId name) const { return findSlotInternal(potions_, name) != IndexPolicy::NOT_FOUND; }
+    bool containsTrophy(SymbolId name) const { return findSlotInternal(trophies_, name) != IndexPolicy::NOT_FOUND; }
+
+    // Public interface for ingredients
+    void addIngredient(SymbolId name, int quantity) { addOrUpdateItemInternal(ingredients_, name, quantity); }
+    int getIngredientQuantity(SymbolId name) const { return getItemQuantityInternal(ingredients_, name); }
+    bool useIngredient(SymbolId name, int quantity) { return useItemInternal(ingredients_, name, quantity); }
+    void printAllIngredients(OutputWriter& out) const { printAllItemsInternal(out, ingredients_, Messages::NONE); }
+
+    // Public interface for potions
+    void addPotion(SymbolId name, int quantity) { addOrUpdateItemInternal(potions_, name, quantity); }
+    int getPotionQuantity(SymbolId name) const { return getItemQuantityInternal(potions_, name); }
+    bool usePotion(SymbolId name, int quantity) { return useItemInternal(potions_, name, quantity); }
+    uint32_t reservePotionSlot(SymbolId name) { return reserveSlotInternal(potions_, name); }
+    int potionQuantityAt(uint32_t slot) const { return potions_.items[slot].quantity; }
+    bool usePotionAt(uint32_t slot, int quantity) { return useSlotInternal(potions_, slot, quantity); }
+    void printAllPotions(OutputWriter& out) const { printAllItemsInternal(out, potions_, Messages::NONE); }
+
+    // Public interface for trophies
+    void addTrophy(SymbolId name, int quantity) { addOrUpdateItemInternal(trophies_, name, quantity); }
+    int getTrophyQuantity(SymbolId name) const { return getItemQuantityInternal(trophies_, name); }
+    bool useTrophy(SymbolId name, int quantity) { return useItemInternal(trophies_, name, quantity); }
+    void printAllTrophies(OutputWriter& out) const { printAllItemsInternal(out, trophies_, Messages::NONE); }
+};
+
+// Both policies are compiled in every build; defining WITCHER_LINEAR_SCAN_INVENTORY
+// makes the game use the linear scan instead of the hash index.
+template class BasicInventory<LinearScanIndex>;
+template class BasicInventory<FlatHashIndex>;
+
+#ifdef WITCHER_LINEAR_SCAN_INVENTORY
+using Inventory = BasicInventory<LinearScanIndex>;
+#else
+using Inventory = BasicInventory<FlatHashIndex>;
+#endif
+
+// Represents a single potion formula
+class PotionFormula {
+public:
+    SymbolId potion_name;
+    std::vector<IngredientRequirement> requirements;
+    std::vector<SlotRequirement> compiled; // Same requirements, by inventory slot, for brewing
+    std::vector<SlotRequirement> totals;   // One entry per distinct slot, for batch brewing
+
+    PotionFormula(SymbolId name, std::vector<IngredientRequirement> reqs, std::vector<SlotRequirement> slots)
+        : potion_name(name), requirements(std::move(reqs)), compiled(std::move(slots)) {
+        for (const SlotRequirement& req : compiled) {
+            auto same_slot = std::find_if(totals.begin(), totals.end(),
+                                          [&req](const SlotRequirement& t) { return t.slot == req.slot; });
+            if (same_slot == totals.end()) {
+                totals.push_back(req);
+            } else { // Listed twice: a batch needs the sum (saturated, since it can never be met)
+                same_slot->quantity = static_cast<int>(std::min<long long>(INT_MAX, 1LL * same_slot->quantity + req.quantity));
+            }
+        }
+    }
 
     // Prints the formula's requirements in a sorted format
-    void print() const {
+    void print(OutputWriter& out, const SymbolTable& symbols) const {
         if (requirements.empty()) {
             return; // Should not happen for a valid formula
         }
         std::vector<IngredientRequirement> sorted_reqs = requirements; // Make a copy to sort
-        std::sort(sorted_reqs.begin(), sorted_reqs.end(), IngredientRequirement::compareForFormula);
+        std::sort(sorted_reqs.begin(), sorted_reqs.end(), [&symbols](const IngredientRequirement& a, const IngredientRequirement& b) {
+            return IngredientRequirement::compareForFormula(symbols, a, b);
+        });
         for (size_t i = 0; i < sorted_reqs.size(); ++i) {
             if (i > 0) {
-                std::cout << ", ";
+                out << ", ";
             }
-            std::cout << sorted_reqs[i].quantity << " " << sorted_reqs[i].ingredient_name;
+            out << sorted_reqs[i].quantity << " " << symbols.name(sorted_reqs[i].ingredient_name);
         }
-        std::cout << std::endl;
+        out << '\n';
     }
 };
 
-// Manages known potion formulae
-class AlchemyBase {
+// Manages known potion formulae, and tracks which of them the inventory can brew right now
+class AlchemyBase : public IngredientObserver {
 private:
-    std::vector<PotionFormula> formulae_;
+    // A formula that needs `quantity` of some ingredient in total
+    struct FormulaUse {
+        uint32_t formula;
+        int quantity;
+    };
 
-public:
-    const PotionFormula* findFormula(const std::string& potion_name) const {
-        for (const auto& formula : formulae_) {
-            if (formula.potion_name == potion_name) {
-                return &formula;
-            }
+    const SymbolTable& symbols_;
+    SlabPool<PotionFormula> formulae_;
+    FlatSymbolMap<uint32_t> by_potion_; // Potion name -> slot in formulae_
+    std::vector<std::vector<FormulaUse>> uses_by_slot_; // Ingredient slot -> formulas needing it
+    std::vector<uint32_t> satisfied_; // Per formula: how many of its `totals` are in stock
+    std::set<std::string_view> brewable_; // Names of formulas with every total in stock
+    std::mutex brewable_mutex_; // Guards satisfied_ and brewable_ during parallel apply
+
+    // Records that one of the formula's totals became covered (or stopped being covered)
+    void updateSatisfied(uint32_t formula, bool covered) {
+        const PotionFormula& f = formulae_[formula];
+        if (covered) {
+            if (++satisfied_[formula] == f.totals.size()) brewable_.insert(symbols_.name(f.potion_name));
+        } else {
+            if (satisfied_[formula]-- == f.totals.size()) brewable_.erase(symbols_.name(f.potion_name));
         }
-        return nullptr;
     }
 
+public:
+    explicit AlchemyBase(const SymbolTable& symbols) : symbols_(symbols) {}
+
+    const PotionFormula* findFormula(SymbolId potion_name) const {
+        const uint32_t* position = by_potion_.find(potion_name);
+        return position ? &formulae_[*position] : nullptr;
+    }
+
+    const SlabPool<PotionFormula>& formulae() const { return formulae_; } // In learn order, for snapshots
+
     // Adds a new formula. Does not check if already known; caller should handle that.
-    bool addFormula(const std::string& potion_name, const std::vector<IngredientRequirement>& reqs) {
+    // `slots` holds the inventory slot of each requirement, in the same order;
+    // `inventory` (any BasicInventory) supplies their current quantities.
+    template <typename InventoryT>
+    bool addFormula(SymbolId potion_name, const std::vector<IngredientRequirement>& reqs, std::vector<SlotRequirement> slots,
+                    const InventoryT& inventory) {
         if (formulae_.size() >= GameConstants::MAX_ITEMS) { // Check capacity
-            return false; 
+            return false;
         }
         if (reqs.empty() || reqs.size() > GameConstants::MAX_RECIPE_INGREDIENTS) { // Validate requirements
-            return false; 
+            return false;
+        }
+        uint32_t formula = formulae_.emplace(potion_name, reqs, std::move(slots));
+        by_potion_.insert(potion_name, formula);
+        if (formula >= satisfied_.size()) satisfied_.resize(formula + 1);
+        satisfied_[formula] = 0;
+        for (const SlotRequirement& total : formulae_[formula].totals) {
+            if (total.slot >= uses_by_slot_.size()) uses_by_slot_.resize(total.slot + 1);
+            uses_by_slot_[total.slot].push_back({formula, total.quantity});
+            if (inventory.ingredientQuantityAt(total.slot) >= total.quantity) updateSatisfied(formula, true);
         }
-        formulae_.emplace_back(potion_name, reqs);
         return true;
     }
 
-    void printFormulaForPotion(const std::string& potion_name) const {
+    // Re-evaluates only the formulas that use the changed ingredient
+    void onIngredientChanged(uint32_t slot, int old_quantity, int new_quantity) override {
+        if (slot >= uses_by_slot_.size()) return;
+        for (const FormulaUse& use : uses_by_slot_[slot]) {
+            bool was_covered = old_quantity >= use.quantity;
+            bool is_covered = new_quantity >= use.quantity;
+            if (was_covered != is_covered) {
+                std::lock_guard<std::mutex> lock(brewable_mutex_);
+                updateSatisfied(use.formula, is_covered);
+            }
+        }
+    }
+
+    // Prints the potions that can be brewed right now, sorted by name
+    void printBrewable(OutputWriter& out) const {
+        if (brewable_.empty()) {
+            out << Messages::NONE;
+            return;
+        }
+        bool first = true;
+        for (std::string_view name : brewable_) {
+            if (!first) {
+                out << ", ";
+            }
+            out << name;
+            first = false;
+        }
+        out << '\n';
+    }
+
+    void printFormulaForPotion(OutputWriter& out, SymbolId potion_name, std::string_view display_name) const {
         const PotionFormula* formula = findFormula(potion_name);
         if (formula) {
-            formula->print();
+            formula->print(out, symbols_);
         } else {
-            std::cout << "No formula for " << potion_name << std::endl;
+            out << "No formula for " << display_name << '\n';
         }
     }
 };
@@ -899,314 +1899,1359 @@ public:
 // Represents an entry in the bestiary for a single monster
 class BestiaryEntry {
 public:
-    std::string monster_name;
+    SymbolId monster_name;
     std::vector<EffectiveItem> effective_items; // Items known to be effective against this monster
+    bool has_sign = false;               // Any of effective_items is a sign
+    std::vector<uint32_t> potion_slots;  // Inventory slots of the effective potions, in learn order
 
-    BestiaryEntry(std::string name) : monster_name(std::move(name)) {}
-
-    bool isEffectivenessKnown(const std::string& item_name) const {
-        for (const auto& eff_item : effective_items) {
-            if (eff_item.name == item_name) {
-                return true;
-            }
-        }
-        return false;
-    }
+    BestiaryEntry(SymbolId name) : monster_name(name) {}
 
-    // Adds a known effective item. Returns false if already known or list is full.
-    bool addKnownEffectiveness(const std::string& item_name, EffectivenessType type) {
-        if (isEffectivenessKnown(item_name)) { // Should ideally be checked by Bestiary class
-            return false; 
-        }
-        if (effective_items.size() < GameConstants::MAX_EFFECTIVE_ITEMS) {
-            effective_items.emplace_back(item_name, type);
-            return true;
+    // Appends an effective item; the Bestiary has already checked it is not known.
+    // `potion_slot` is the potion's inventory slot and is ignored for signs.
+    void addKnownEffectiveness(SymbolId item_name, EffectivenessType type, uint32_t potion_slot) {
+        effective_items.emplace_back(item_name, type);
+        if (type == EffectivenessType::SIGN) {
+            has_sign = true;
+        } else {
+            potion_slots.push_back(potion_slot);
         }
-        return false; // List full
     }
 
     // Prints all known effective items for this monster, sorted by name.
-    void printEffectiveness() const {
+    void printEffectiveness(OutputWriter& out, const SymbolTable& symbols) const {
         if (effective_items.empty()) {
             // The "No knowledge" message is handled by the Bestiary class
             return;
         }
         std::vector<EffectiveItem> sorted_items = effective_items; // Make a copy to sort
-        std::sort(sorted_items.begin(), sorted_items.end(), EffectiveItem::compareByName);
+        std::sort(sorted_items.begin(), sorted_items.end(), [&symbols](const EffectiveItem& a, const EffectiveItem& b) {
+            return EffectiveItem::compareByName(symbols, a, b);
+        });
         for (size_t i = 0; i < sorted_items.size(); ++i) {
             if (i > 0) {
-                std::cout << ", ";
+                out << ", ";
             }
-            std::cout << sorted_items[i].name;
+            out << symbols.name(sorted_items[i].name);
         }
-        std::cout << std::endl;
+        out << '\n';
     }
 };
 
 // Manages all bestiary entries
 class Bestiary {
 private:
-    std::vector<BestiaryEntry> entries_; // List of all known monster entries
+    const SymbolTable& symbols_;
+    SlabPool<BestiaryEntry> entries_; // All known monster entries
+    FlatSymbolMap<uint32_t> by_monster_; // Monster name -> slot in entries_
+    std::unordered_set<uint64_t> known_pairs_; // pairKey(monster, item) of every known effectiveness
+    FlatSymbolMap<uint32_t> by_item_; // Item name -> position in monsters_by_item_
+    std::vector<std::set<std::string_view>> monsters_by_item_; // Monsters each item is effective against, by name
+
+    static uint64_t pairKey(SymbolId monster_name, SymbolId item_name) {
+        return (static_cast<uint64_t>(monster_name) << 32) | item_name;
+    }
 
     // Helper to find a bestiary entry by monster name
-    BestiaryEntry* findEntryInternal(const std::string& monster_name) {
-        for (auto& entry : entries_) {
-            if (entry.monster_name == monster_name) {
-                return &entry;
-            }
-        }
-        return nullptr;
+    BestiaryEntry* findEntryInternal(SymbolId monster_name) {
+        const uint32_t* position = by_monster_.find(monster_name);
+        return position ? &entries_[*position] : nullptr;
     }
     // Const version of findEntryInternal
-     const BestiaryEntry* findEntryInternalConst(const std::string& monster_name) const {
-        for (const auto& entry : entries_) {
-            if (entry.monster_name == monster_name) {
-                return &entry;
-            }
-        }
-        return nullptr;
+    const BestiaryEntry* findEntryInternalConst(SymbolId monster_name) const {
+        const uint32_t* position = by_monster_.find(monster_name);
+        return position ? &entries_[*position] : nullptr;
     }
 
 public:
-    const BestiaryEntry* findEntry(const std::string& monster_name) const {
+    explicit Bestiary(const SymbolTable& symbols) : symbols_(symbols) {}
+
+    const BestiaryEntry* findEntry(SymbolId monster_name) const {
         return findEntryInternalConst(monster_name);
     }
 
+    const SlabPool<BestiaryEntry>& entries() const { return entries_; } // In learn order, for snapshots
+
+    bool isEffectivenessKnown(SymbolId monster_name, SymbolId item_name) const {
+        return known_pairs_.count(pairKey(monster_name, item_name)) != 0;
+    }
+
     // Adds or updates effectiveness data for a monster.
+    // For potions, `potion_slot` is the potion's inventory slot (see Inventory::reservePotionSlot).
     // Returns:
     //   2: New monster entry created & item added
     //   1: Existing monster entry updated
     //   0: Item effectiveness already known for this monster
-    //  -1: Could not add (e.g., Bestiary full, or monster's effective item list full)
-    int addOrUpdateEffectiveness(const std::string& monster_name, const std::string& item_name, EffectivenessType type) {
+    int addOrUpdateEffectiveness(SymbolId monster_name, SymbolId item_name, EffectivenessType type, uint32_t potion_slot) {
+        if (!known_pairs_.insert(pairKey(monster_name, item_name)).second) {
+            return 0; // Already known
+        }
+        const uint32_t* item_position = by_item_.find(item_name);
+        if (!item_position) {
+            by_item_.insert(item_name, static_cast<uint32_t>(monsters_by_item_.size()));
+            monsters_by_item_.emplace_back();
+            item_position = by_item_.find(item_name);
+        }
+        monsters_by_item_[*item_position].insert(symbols_.name(monster_name));
         BestiaryEntry* entry = findEntryInternal(monster_name);
         if (entry) { // Monster already exists in bestiary
-            if (entry->isEffectivenessKnown(item_name)) {
-                return 0; // Already known
-            }
-            if (entry->addKnownEffectiveness(item_name, type)) { // Try to add to existing entry
-                return 1; // Existing entry updated
-            } else {
-                return -1; // Monster's effective items list is full
-            }
-        } else { // New monster
-            if (entries_.size() < GameConstants::MAX_ITEMS) { // Check if Bestiary itself is full
-                entries_.emplace_back(monster_name); // Create new entry for the monster
-                BestiaryEntry* new_entry = &entries_.back();
-                if (new_entry->addKnownEffectiveness(item_name, type)) { // Add item to the new entry
-                    return 2; // New entry added, item added
-                } else {
-                    // This case (new_entry's list full immediately) is unlikely unless MAX_EFFECTIVE_ITEMS is 0.
-                    entries_.pop_back(); // Rollback creation of empty/unusable entry
-                    return -1; // Treat as an error/limit reached
+            entry->addKnownEffectiveness(item_name, type, potion_slot);
+            return 1; // Existing entry updated
+        }
+        // New monster
+        uint32_t slot = entries_.emplace(monster_name); // Create new entry for the monster
+        by_monster_.insert(monster_name, slot);
+        entries_[slot].addKnownEffectiveness(item_name, type, potion_slot);
+        return 2; // New entry added, item added
+    }
+
+    // Snapshot loading: sizes the known-pair set for the `pairs` effectiveness records to come
+    void reserveForRestore(size_t pairs) { known_pairs_.reserve(pairs); }
+
+    // Snapshot loading: like addOrUpdateEffectiveness, but leaves the item -> monsters index
+    // to rebuildItemIndex(), which sorts once instead of inserting name by name.
+    // Returns false if the effectiveness is already known.
+    bool restoreEffectiveness(SymbolId monster_name, SymbolId item_name, EffectivenessType type, uint32_t potion_slot) {
+        if (!known_pairs_.insert(pairKey(monster_name, item_name)).second) {
+            return false;
+        }
+        BestiaryEntry* entry = findEntryInternal(monster_name);
+        if (!entry) {
+            uint32_t slot = entries_.emplace(monster_name);
+            by_monster_.insert(monster_name, slot);
+            entry = &entries_[slot];
+        }
+        entry->addKnownEffectiveness(item_name, type, potion_slot);
+        return true;
+    }
+
+    // Builds the item -> monsters index from the entries, after restoreEffectiveness calls.
+    // Visiting entries in monster-name order makes every set insertion an append.
+    void rebuildItemIndex() {
+        std::vector<uint32_t> order(entries_.size()); // Entry slots, sorted by monster name
+        for (uint32_t slot = 0; slot < entries_.size(); ++slot) {
+            order[slot] = slot;
+        }
+        std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+            return symbols_.name(entries_[a].monster_name) < symbols_.name(entries_[b].monster_name);
+        });
+        for (uint32_t slot : order) {
+            const BestiaryEntry& entry = entries_[slot];
+            std::string_view monster = symbols_.name(entry.monster_name);
+            for (const EffectiveItem& item : entry.effective_items) {
+                const uint32_t* position = by_item_.find(item.name);
+                if (!position) {
+                    by_item_.insert(item.name, static_cast<uint32_t>(monsters_by_item_.size()));
+                    monsters_by_item_.emplace_back();
+                    position = by_item_.find(item.name);
                 }
-            } else {
-                return -1; // Bestiary (list of monsters) is full
+                std::set<std::string_view>& monsters = monsters_by_item_[*position];
+                monsters.insert(monsters.end(), monster);
+            }
+        }
+    }
+
+    // Prints the monsters a potion or sign is known to be effective against, sorted by name
+    void printMonstersForItem(OutputWriter& out, SymbolId item_name, std::string_view display_name) const {
+        const uint32_t* position = by_item_.find(item_name);
+        if (!position) {
+            out << "No knowledge of " << display_name << '\n';
+            return;
+        }
+        bool first = true;
+        for (std::string_view monster : monsters_by_item_[*position]) {
+            if (!first) {
+                out << ", ";
             }
+            out << monster;
+            first = false;
         }
+        out << '\n';
     }
 
-    void printEffectivenessForMonster(const std::string& monster_name) const {
+    void printEffectivenessForMonster(OutputWriter& out, SymbolId monster_name, std::string_view display_name) const {
         const BestiaryEntry* entry = findEntry(monster_name);
         if (entry && !entry->effective_items.empty()) {
-            entry->printEffectiveness();
+            entry->printEffectiveness(out, symbols_);
         } else {
-            std::cout << "No knowledge of " << monster_name << std::endl;
+            out << "No knowledge of " << display_name << '\n';
         }
     }
 };
 
 // Parses command strings into Parsed::Command objects
+// Lines are copied into a batch-lifetime LineArena and the returned commands hold
+// views into it, so parsing a warmed-up batch performs no heap allocation.
 class CommandParser {
+private:
+    LineArena arena_; // Backing storage for the current batch of parsed commands
+
 public:
     CommandParser() = default;
 
-    Parsed::Command parse(const std::string& line_str) {
-        return parse_command_internal(line_str); // Calls the C++ style internal parser
+    // The returned command stays valid until the next call to endBatch()
+    Parsed::Command parse(std::string_view line_str) {
+        return parse_command_internal(arena_.copy(line_str), arena_); // Calls the C++ style internal parser
+    }
+
+    // Like parse(), but without copying: the command points into `line_str`,
+    // which must outlive it as well
+    Parsed::Command parseInPlace(std::string_view line_str) {
+        return parse_command_internal(line_str, arena_);
+    }
+
+    // Invalidates every command parsed since the previous call
+    void endBatch() {
+        arena_.reset();
     }
 };
 
-// Main Game Application Class
-class WitcherGame {
-private:
-    Inventory inventory_;
-    AlchemyBase alchemy_base_;
-    Bestiary bestiary_;
-    CommandParser parser_;
+// Heap allocation statistics of the parse step, reported on request at exit
+struct ParseAllocationStats {
+    unsigned long long commands = 0;              // Lines parsed
+    unsigned long long allocations = 0;           // Heap allocations made while parsing
+    unsigned long long allocating_commands = 0;   // Lines whose parse allocated at least once
 
-    // These methods process the data from Parsed::Command objects.
+    void recordParse(unsigned long long allocations_made) {
+        ++commands;
+        allocations += allocations_made;
+        if (allocations_made > 0) ++allocating_commands;
+    }
 
-    void handleLoot(const Parsed::Command& cmd) {
-        // Safely get the payload using std::get_if
-        if (const auto* payload = std::get_if<Parsed::LootPayload>(&cmd.data)) {
-            for (const auto& item_info : payload->items) {
-                inventory_.addIngredient(item_info.name, item_info.quantity);
-            }
-            std::cout << "Alchemy ingredients obtained" << std::endl;
-        } else {
-            // This should not happen if cmd.type is LOOT. Indicates a logic error.
-            std::cout << "INVALID" << std::endl;
+    void report(std::ostream& os) const {
+        if (!AllocationCounter::enabled) {
+            os << "parse: heap allocations are not counted in this build (define WITCHER_COUNT_ALLOCATIONS)" << '\n';
+            return;
         }
+        os << "parse: " << commands << " commands, " << allocations << " heap allocations, "
+           << allocating_commands << " commands allocated" << '\n';
     }
+};
 
-    void handleTrade(const Parsed::Command& cmd) {
-         if (const auto* payload = std::get_if<Parsed::TradePayload>(&cmd.data)) {
-            // Check if Geralt has enough trophies to trade
+// Source of command lines for WitcherGame::run. Lines are returned without their '\n'
+// and stay valid until the next call to nextLine.
+class InputSource {
+public:
+    virtual ~InputSource() = default;
+    // Returns false once the input is exhausted
+    virtual bool nextLine(std::string_view& line) = 0;
+    // True if lines stay valid for the source's whole lifetime, so readers need not copy them
+    virtual bool linesOutliveSource() const { return false; }
+    // Called from another thread: makes a nextLine blocked on input that has not arrived
+    // yet return false, and every later call too. Sources that never block ignore it.
+    virtual void cancel() {}
+};
+
+// Reads through std::getline; used for interactive sessions and where POSIX I/O is missing
+class StreamInput : public InputSource {
+private:
+    std::istream& stream_;
+    std::string line_;
+
+public:
+    explicit StreamInput(std::istream& stream) : stream_(stream) {}
+
+    bool nextLine(std::string_view& line) override {
+        if (!std::getline(stream_, line_)) return false;
+        line = line_;
+        return true;
+    }
+};
+
+// Splits the next line off [cursor, end) with memchr; the final line may lack its '\n'
+inline bool split_line(const char*& cursor, const char* end, std::string_view& line) {
+    if (cursor == end) return false;
+    const char* newline = static_cast<const char*>(std::memchr(cursor, '\n', static_cast<size_t>(end - cursor)));
+    const char* line_end = newline ? newline : end;
+    line = std::string_view(cursor, static_cast<size_t>(line_end - cursor));
+    cursor = newline ? newline + 1 : end;
+    return true;
+}
+
+#if WITCHER_POSIX
+
+// Maps a whole regular file into memory; lines are views straight into the mapped pages
+class MappedFileInput : public InputSource {
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    const char* cursor_ = nullptr;
+
+public:
+    // Maps `fd`, which must refer to a regular file; ok() reports whether that worked
+    explicit MappedFileInput(int fd) {
+        struct stat info;
+        if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) return;
+        size_ = static_cast<size_t>(info.st_size);
+        if (size_ == 0) { // mmap rejects empty mappings; an empty file simply has no lines
+            cursor_ = data_ = "";
+            return;
+        }
+        void* mapped = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            size_ = 0;
+            return;
+        }
+        madvise(mapped, size_, MADV_SEQUENTIAL);
+        cursor_ = data_ = static_cast<const char*>(mapped);
+    }
+
+    MappedFileInput(const MappedFileInput&) = delete;
+    MappedFileInput& operator=(const MappedFileInput&) = delete;
+
+    ~MappedFileInput() override {
+        if (size_ > 0) munmap(const_cast<char*>(data_), size_);
+    }
+
+    bool ok() const { return data_ != nullptr; }
+
+    bool linesOutliveSource() const override { return true; }
+
+    bool nextLine(std::string_view& line) override {
+        return split_line(cursor_, data_ + size_, line);
+    }
+};
+
+// Reads pipes and terminals with large read(2) calls into one buffer that grows only
+// when a single line does not fit. Each read waits in poll(2) together with a self-pipe,
+// so cancel() can wake a reader blocked on a pipe or FIFO whose writer stays open.
+class FdReadInput : public InputSource {
+private:
+    int fd_;
+    int wake_fds_[2] = {-1, -1}; // Self-pipe; cancel() writes to [1]
+    std::atomic<bool> cancelled_{false};
+    std::unique_ptr<char[]> buffer_;
+    size_t capacity_;
+    const char* cursor_; // Start of the unconsumed bytes
+    const char* end_;    // End of the bytes read so far
+    bool eof_ = false;
+
+    // Blocks until `fd_` is readable; false if cancel() was called first
+    bool waitReadable() {
+        if (wake_fds_[0] < 0) return !cancelled_.load(std::memory_order_acquire);
+        pollfd fds[2] = {{fd_, POLLIN, 0}, {wake_fds_[0], POLLIN, 0}};
+        int ready;
+        do {
+            ready = poll(fds, 2, -1);
+        } while (ready < 0 && errno == EINTR);
+        return ready > 0 && fds[1].revents == 0;
+    }
+
+    // Moves the unconsumed bytes to the front, grows the buffer if they fill it, and reads more
+    void refill() {
+        size_t pending = static_cast<size_t>(end_ - cursor_);
+        if (pending == capacity_) {
+            std::unique_ptr<char[]> larger(new char[capacity_ * 2]);
+            std::memcpy(larger.get(), cursor_, pending);
+            buffer_ = std::move(larger);
+            capacity_ *= 2;
+        } else {
+            std::memmove(buffer_.get(), cursor_, pending);
+        }
+        cursor_ = buffer_.get();
+        end_ = cursor_ + pending;
+        if (!waitReadable()) {
+            eof_ = true;
+            return;
+        }
+        ssize_t got;
+        do {
+            got = read(fd_, buffer_.get() + pending, capacity_ - pending);
+        } while (got < 0 && errno == EINTR);
+        if (got <= 0) {
+            eof_ = true;
+        } else {
+            end_ += got;
+        }
+    }
+
+public:
+    explicit FdReadInput(int fd, size_t capacity = GameConstants::INPUT_BUFFER_SIZE)
+        : fd_(fd), buffer_(new char[capacity]), capacity_(capacity), cursor_(buffer_.get()), end_(buffer_.get()) {
+        if (pipe(wake_fds_) != 0) { // Without it cancel() only takes effect before the next read
+            wake_fds_[0] = wake_fds_[1] = -1;
+        }
+    }
+
+    FdReadInput(const FdReadInput&) = delete;
+    FdReadInput& operator=(const FdReadInput&) = delete;
+
+    ~FdReadInput() override {
+        if (wake_fds_[0] >= 0) {
+            close(wake_fds_[0]);
+            close(wake_fds_[1]);
+        }
+    }
+
+    bool nextLine(std::string_view& line) override {
+        while (!eof_ && !std::memchr(cursor_, '\n', static_cast<size_t>(end_ - cursor_))) {
+            refill();
+        }
+        if (cancelled_.load(std::memory_order_acquire)) return false;
+        return split_line(cursor_, end_, line);
+    }
+
+    void cancel() override {
+        cancelled_.store(true, std::memory_order_release);
+        if (wake_fds_[1] >= 0) {
+            char byte = 0;
+            ssize_t written = write(wake_fds_[1], &byte, 1);
+            (void)written; // A full pipe already wakes the reader
+        }
+    }
+};
+#endif
+
+// Picks the input for a run: a memory map for files (--input, or stdin redirected from
+// one), large reads for other batch input, and getline for interactive sessions.
+// Returns nullptr, after printing why, if --input cannot be opened.
+std::unique_ptr<InputSource> openInput(const std::string& path, bool batch) {
+#if WITCHER_POSIX
+    if (!path.empty()) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "cannot open " << path << ": " << std::strerror(errno) << '\n';
+            return nullptr;
+        }
+        auto mapped = std::make_unique<MappedFileInput>(fd);
+        close(fd); // The mapping stays valid without the descriptor
+        if (!mapped->ok()) {
+            std::cerr << "cannot map " << path << '\n';
+            return nullptr;
+        }
+        return mapped;
+    }
+    if (batch) {
+        auto mapped = std::make_unique<MappedFileInput>(STDIN_FILENO);
+        if (mapped->ok()) return mapped;
+        return std::make_unique<FdReadInput>(STDIN_FILENO);
+    }
+#else
+    if (!path.empty()) {
+        std::cerr << "--input is not supported on this platform" << '\n';
+        return nullptr;
+    }
+    (void)batch;
+#endif
+    return std::make_unique<StreamInput>(std::cin);
+}
+
+// Command-line options of the executable
+struct RunOptions {
+    bool report_parse_allocations = false; // --report-parse-allocations: print ParseAllocationStats to stderr at exit (serial runs)
+    std::string bench_name;                // --bench <name>: run a microbenchmark instead of the game
+    std::optional<bool> batch;             // --batch / --interactive; by default, batch unless stdin is a terminal
+    std::string input_path;                // --input <file>: read commands from a memory-mapped file instead of stdin
+    size_t pipeline_lanes = 0;             // --pipeline <N>: batch runs parse on N threads (0 = serial)
+    bool report_pipeline = false;          // --report-pipeline: print CommandPipeline stats to stderr at exit
+    size_t parallel_threads = 0;           // --parallel <N>: batch runs apply independent commands on N threads
+    bool report_parallel = false;          // --report-parallel: print ParallelApplier stats to stderr at exit
+    std::string serve_path;                // --serve <path>: serve sessions on a Unix-domain socket
+    size_t shards = 0;                     // --shards <N>: session shards for --serve (0 = one per core)
+    std::string connect_path;              // --connect <path>: send stdin to a server, print its answers
+    std::string load_path;                 // --load <path>: run the load generator against a server
+    size_t connections = 64;               // --connections <N>: load generator connections
+    std::string load_snapshot_path;        // --load-snapshot <file>: start from a saved state instead of an empty one
+    std::string save_snapshot_path;        // --save-snapshot <file>: save the state when the input ends
+    std::string wal_path;                  // --wal <file>: log state-changing commands and recover from the log
+    size_t group_commit = 512;             // --group-commit <N>: log records per fsync in batch mode
+    bool report_wal = false;               // --report-wal: print CommandLog stats to stderr at exit
+    std::string replay_path;               // --replay <file>: start from the state as of a recorded session's command N
+    uint64_t seek_command = 0;             // --seek <N>: that N (0 = the end of the recording)
+    uint64_t checkpoint_interval = 100000; // --checkpoint-every <N>: commands between replay checkpoints
+    bool verify_replay = false;            // --verify: checksum the whole replay log before trusting its checkpoint index
+    std::string checkpoint_dir;            // --checkpoint-dir <dir>: keep replay checkpoints there across runs
+    bool report_replay = false;            // --report-replay: print ReplayEngine stats to stderr at exit
+    bool report_stats = false;             // --report-stats: print EngineStats to stderr at exit
+
+    // Parses argv; returns std::nullopt on an unknown option
+    static std::optional<RunOptions> fromArgs(int argc, char* argv[]) {
+        RunOptions options;
+        for (int i = 1; i < argc; ++i) {
+            std::string_view arg(argv[i]);
+            if (arg == "--report-parse-allocations") {
+                options.report_parse_allocations = true;
+            } else if (arg == "--bench" && i + 1 < argc) {
+                options.bench_name = argv[++i];
+            } else if (arg == "--input" && i + 1 < argc) {
+                options.input_path = argv[++i];
+            } else if (arg == "--pipeline" && i + 1 < argc) {
+                auto lanes = ParserUtils::parse_quantity(argv[++i]);
+                if (!lanes) return std::nullopt;
+                options.pipeline_lanes = static_cast<size_t>(lanes.value());
+            } else if (arg == "--report-pipeline") {
+                options.report_pipeline = true;
+            } else if (arg == "--parallel" && i + 1 < argc) {
+                auto threads = ParserUtils::parse_quantity(argv[++i]);
+                if (!threads) return std::nullopt;
+                options.parallel_threads = static_cast<size_t>(threads.value());
+            } else if (arg == "--report-parallel") {
+                options.report_parallel = true;
+            } else if (arg == "--serve" && i + 1 < argc) {
+                options.serve_path = argv[++i];
+            } else if (arg == "--shards" && i + 1 < argc) {
+                auto shards = ParserUtils::parse_quantity(argv[++i]);
+                if (!shards) return std::nullopt;
+                options.shards = static_cast<size_t>(shards.value());
+            } else if (arg == "--connect" && i + 1 < argc) {
+                options.connect_path = argv[++i];
+            } else if (arg == "--load" && i + 1 < argc) {
+                options.load_path = argv[++i];
+            } else if (arg == "--connections" && i + 1 < argc) {
+                auto connections = ParserUtils::parse_quantity(argv[++i]);
+                if (!connections || connections.value() == 0) return std::nullopt;
+                options.connections = static_cast<size_t>(connections.value());
+            } else if (arg == "--load-snapshot" && i + 1 < argc) {
+                options.load_snapshot_path = argv[++i];
+            } else if (arg == "--save-snapshot" && i + 1 < argc) {
+                options.save_snapshot_path = argv[++i];
+            } else if (arg == "--wal" && i + 1 < argc) {
+                options.wal_path = argv[++i];
+            } else if (arg == "--group-commit" && i + 1 < argc) {
+                auto group = ParserUtils::parse_quantity(argv[++i]);
+                if (!group || group.value() == 0) return std::nullopt;
+                options.group_commit = static_cast<size_t>(group.value());
+            } else if (arg == "--report-wal") {
+                options.report_wal = true;
+            } else if (arg == "--replay" && i + 1 < argc) {
+                options.replay_path = argv[++i];
+            } else if (arg == "--seek" && i + 1 < argc) {
+                auto command = ParserUtils::parse_quantity(argv[++i]);
+                if (!command) return std::nullopt;
+                options.seek_command = static_cast<uint64_t>(command.value());
+            } else if (arg == "--checkpoint-every" && i + 1 < argc) {
+                auto interval = ParserUtils::parse_quantity(argv[++i]);
+                if (!interval) return std::nullopt;
+                options.checkpoint_interval = static_cast<uint64_t>(interval.value());
+            } else if (arg == "--checkpoint-dir" && i + 1 < argc) {
+                options.checkpoint_dir = argv[++i];
+            } else if (arg == "--verify") {
+                options.verify_replay = true;
+            } else if (arg == "--report-replay") {
+                options.report_replay = true;
+            } else if (arg == "--report-stats") {
+                options.report_stats = true;
+            } else if (arg == "--batch") {
+                options.batch = true;
+            } else if (arg == "--interactive") {
+                options.batch = false;
+            } else {
+                return std::nullopt;
+            }
+        }
+        if (options.pipeline_lanes > 0 && options.parallel_threads > 0) {
+            return std::nullopt; // Two different executors
+        }
+        if (!options.wal_path.empty() && (options.pipeline_lanes > 0 || options.parallel_threads > 0)) {
+            return std::nullopt; // The command log is written by the serial loop
+        }
+        if (!options.replay_path.empty() && (options.pipeline_lanes > 0 || options.parallel_threads > 0 ||
+                                             !options.wal_path.empty() || !options.load_snapshot_path.empty())) {
+            return std::nullopt; // A replayed session starts from the recording and runs serially
+        }
+        return options;
+    }
+};
+
+// Binary snapshot of a game's state (--save-snapshot / --load-snapshot).
+// Layout: a fixed Header, then one array of fixed-width records per section, each starting
+// on an 8-byte boundary. Records refer to names by SymbolId (their position in STRINGS),
+// and to other records and bytes by offsets and counts, never by pointers, so a mapped
+// file is used in place: names stay in the mapping and records are read where they lie.
+// Only the primary state is stored; indexes, stock listings and brewability are rebuilt.
+// Integers are in host byte order; `byte_order` rejects files from the other kind of host.
+namespace Snapshot {
+    constexpr char MAGIC[8] = {'W', 'I', 'T', 'C', 'H', 'S', 'N', 'P'};
+    constexpr uint32_t VERSION = 2; // 2: log_sequence
+    constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+    enum Section : uint32_t {
+        STRINGS,          // StringRecord per SymbolId
+        STRING_BYTES,     // Name bytes, counted in bytes
+        INGREDIENTS,      // ItemRecord per inventory slot
+        POTIONS,
+        TROPHIES,
+        FORMULAS,         // FormulaRecord per formula, in learn order
+        REQUIREMENTS,     // RequirementRecord, grouped by formula
+        ENTRIES,          // EntryRecord per bestiary entry, in learn order
+        EFFECTIVE_ITEMS,  // EffectiveRecord, grouped by entry, in learn order
+        SECTION_COUNT
+    };
+
+    struct SectionRef {
+        uint64_t offset; // From the start of the file
+        uint64_t count;  // Records (bytes for STRING_BYTES)
+    };
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        uint64_t file_size;
+        uint64_t checksum;  // checksum() of every byte after the header
+        uint64_t log_sequence; // Last CommandLog record included (0 without a log)
+        SectionRef sections[SECTION_COUNT];
+    };
+
+    struct StringRecord { uint64_t offset; uint32_t length; uint32_t reserved; };
+    struct ItemRecord { uint32_t name; int32_t quantity; };
+    struct FormulaRecord { uint32_t potion; uint32_t first_requirement; uint32_t requirement_count; uint32_t reserved; };
+    struct RequirementRecord { uint32_t ingredient; int32_t quantity; };
+    struct EntryRecord { uint32_t monster; uint32_t first_item; uint32_t item_count; uint32_t reserved; };
+    struct EffectiveRecord { uint32_t item; uint32_t type; }; // type: EffectivenessType
+
+    static_assert(sizeof(Header) == 40 + 16 * SECTION_COUNT, "Header layout is part of the format");
+    static_assert(sizeof(StringRecord) == 16 && sizeof(ItemRecord) == 8 && sizeof(FormulaRecord) == 16 &&
+                  sizeof(RequirementRecord) == 8 && sizeof(EntryRecord) == 16 && sizeof(EffectiveRecord) == 8,
+                  "Record layouts are part of the format");
+
+    // 64-bit FNV-1a, enough to catch truncation and stray writes
+    inline uint64_t checksum(const char* data, size_t size) {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ static_cast<unsigned char>(data[i])) * 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    // Assembles a snapshot in memory, one section after another
+    class Builder {
+    private:
+        std::string bytes_;
+        Header header_{};
+
+    public:
+        Builder() { bytes_.resize(sizeof(Header)); }
+
+        // Appends a section and returns its file offset; `size` is in bytes and `count` in records
+        uint64_t addSection(Section section, const void* data, size_t size, size_t count) {
+            bytes_.resize((bytes_.size() + 7) & ~size_t{7}, '\0');
+            header_.sections[section] = SectionRef{bytes_.size(), count};
+            bytes_.append(static_cast<const char*>(data), size);
+            return header_.sections[section].offset;
+        }
+
+        template <typename Record>
+        uint64_t addSection(Section section, const std::vector<Record>& records) {
+            return addSection(section, records.data(), records.size() * sizeof(Record), records.size());
+        }
+
+        // Fills in the header and returns the finished file contents; the builder is spent afterwards
+        std::string finish(uint64_t log_sequence) {
+            header_.log_sequence = log_sequence;
+            std::memcpy(header_.magic, MAGIC, sizeof(MAGIC));
+            header_.version = VERSION;
+            header_.byte_order = BYTE_ORDER_MARK;
+            header_.file_size = bytes_.size();
+            header_.checksum = checksum(bytes_.data() + sizeof(Header), bytes_.size() - sizeof(Header));
+            std::memcpy(&bytes_[0], &header_, sizeof(Header));
+            return std::move(bytes_);
+        }
+    };
+
+    // Writes `contents` to `path` through a temporary file and a rename, so a crash
+    // leaves either the old snapshot or the new one
+    inline bool writeFile(const std::string& path, const std::string& contents) {
+        std::string temporary = path + ".tmp";
+        std::FILE* file = std::fopen(temporary.c_str(), "wb");
+        if (!file) return false;
+        bool ok = std::fwrite(contents.data(), 1, contents.size(), file) == contents.size() && std::fflush(file) == 0;
+#if WITCHER_POSIX
+        ok = ok && fsync(fileno(file)) == 0;
+#endif
+        ok = std::fclose(file) == 0 && ok;
+        if (ok) ok = std::rename(temporary.c_str(), path.c_str()) == 0;
+        if (!ok) std::remove(temporary.c_str());
+        return ok;
+    }
+
+    // A snapshot file held in memory for as long as the game built from it lives:
+    // mapped read-only where mmap is available, read into a buffer otherwise
+    class File {
+    private:
+        const char* data_ = nullptr;
+        size_t size_ = 0;
+        bool mapped_ = false;
+        std::unique_ptr<char[]> buffer_; // Fallback storage, or a copy made by copyOf()
+
+        File() = default;
+
+    public:
+        // A File holding a copy of `bytes`, for snapshots kept in memory
+        static std::unique_ptr<File> copyOf(std::string_view bytes) {
+            std::unique_ptr<File> file(new File());
+            if (bytes.empty()) {
+                file->data_ = ""; // Still ok(), with no bytes
+                return file;
+            }
+            file->buffer_.reset(new char[bytes.size()]);
+            std::memcpy(file->buffer_.get(), bytes.data(), bytes.size());
+            file->data_ = file->buffer_.get();
+            file->size_ = bytes.size();
+            return file;
+        }
+
+        explicit File(const std::string& path) {
+#if WITCHER_POSIX
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) return;
+            struct stat info;
+            if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+                void* mapped = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapped != MAP_FAILED) {
+                    data_ = static_cast<const char*>(mapped);
+                    size_ = static_cast<size_t>(info.st_size);
+                    mapped_ = true;
+                }
+            }
+            close(fd);
+#else
+            std::FILE* file = std::fopen(path.c_str(), "rb");
+            if (!file) return;
+            if (std::fseek(file, 0, SEEK_END) == 0) {
+                long size = std::ftell(file);
+                if (size > 0 && std::fseek(file, 0, SEEK_SET) == 0) {
+                    buffer_.reset(new char[static_cast<size_t>(size)]);
+                    if (std::fread(buffer_.get(), 1, static_cast<size_t>(size), file) == static_cast<size_t>(size)) {
+                        data_ = buffer_.get();
+                        size_ = static_cast<size_t>(size);
+                    }
+                }
+            }
+            std::fclose(file);
+#endif
+        }
+
+        File(const File&) = delete;
+        File& operator=(const File&) = delete;
+
+        ~File() {
+#if WITCHER_POSIX
+            if (mapped_) munmap(const_cast<char*>(data_), size_);
+#endif
+        }
+
+        bool ok() const { return data_ != nullptr; }
+        const char* data() const { return data_; }
+        size_t size() const { return size_; }
+    };
+
+    // The records of one section, or nullptr if it does not fit in the file
+    template <typename Record>
+    const Record* records(const File& file, const Header& header, Section section) {
+        const SectionRef& ref = header.sections[section];
+        if (ref.offset % alignof(Record) != 0 || ref.offset > file.size() ||
+            ref.count > (file.size() - ref.offset) / sizeof(Record)) {
+            return nullptr;
+        }
+        return reinterpret_cast<const Record*>(file.data() + ref.offset);
+    }
+} // namespace Snapshot
+
+#if WITCHER_POSIX
+// Write-ahead log of the lines that change game state (--wal FILE). The file is a
+// LogHeader followed by records of {length, checksum, line bytes}; record i has sequence
+// number base_sequence + i + 1, and a snapshot stores the sequence it includes, so
+// recovery replays exactly the records after it. Appended records are buffered and made
+// durable together by commit() (group commit). Recovery stops at the first torn or
+// corrupt record and cuts the file there: that record was never committed.
+class CommandLog {
+private:
+    static constexpr char MAGIC[8] = {'W', 'I', 'T', 'C', 'H', 'W', 'A', 'L'};
+    static constexpr uint32_t VERSION = 1;
+
+    struct LogHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order; // Snapshot::BYTE_ORDER_MARK
+        uint64_t base_sequence;
+    };
+
+    struct RecordHeader {
+        uint32_t length;
+        uint32_t checksum; // Low half of Snapshot::checksum() of the line
+    };
+
+    std::string path_;
+    int fd_ = -1;
+    size_t group_size_;
+    std::string pending_;          // Records appended since the last commit
+    size_t pending_records_ = 0;
+    uint64_t sequence_ = 0;        // Sequence of the last appended record
+    bool failed_ = false;
+
+    // Statistics
+    unsigned long long records_ = 0;
+    unsigned long long commits_ = 0;
+    unsigned long long bytes_ = 0;
+    std::chrono::steady_clock::duration sync_time_{};
+
+    static uint32_t checksumOf(std::string_view line) {
+        return static_cast<uint32_t>(Snapshot::checksum(line.data(), line.size()));
+    }
+
+    // Reports a failure, with the system's reason when `with_errno` is set
+    bool fail(const char* what, bool with_errno = true) {
+        std::cerr << "command log " << path_ << ": " << what;
+        if (with_errno) std::cerr << ": " << std::strerror(errno);
+        std::cerr << '\n';
+        failed_ = true;
+        return false;
+    }
+
+    static bool writeAll(int fd, const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t written = write(fd, data, size);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+        return true;
+    }
+
+    // Replaces the file with an empty log that starts after `base_sequence`
+    bool create(uint64_t base_sequence) {
+        if (fd_ >= 0) close(fd_);
+        fd_ = -1;
+        std::string temporary = path_ + ".tmp";
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) return fail("cannot create");
+        LogHeader header{};
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.byte_order = Snapshot::BYTE_ORDER_MARK;
+        header.base_sequence = base_sequence;
+        bool ok = writeAll(fd, reinterpret_cast<const char*>(&header), sizeof(header)) && fsync(fd) == 0;
+        close(fd);
+        if (!ok || std::rename(temporary.c_str(), path_.c_str()) != 0) return fail("cannot create");
+        sequence_ = base_sequence;
+        return openForAppend();
+    }
+
+    bool openForAppend() {
+        fd_ = ::open(path_.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        return fd_ >= 0 || fail("cannot open");
+    }
+
+public:
+    explicit CommandLog(size_t group_size) : group_size_(std::max<size_t>(group_size, 1)) {}
+
+    CommandLog(const CommandLog&) = delete;
+    CommandLog& operator=(const CommandLog&) = delete;
+
+    ~CommandLog() {
+        if (fd_ >= 0) close(fd_);
+    }
+
+    // Opens the log at `path`, creating it if needed, and passes every record after
+    // `start_sequence` (the state the game already has) to `replay`, in order.
+    // Returns false, after saying why, if the log cannot be used.
+    bool open(const std::string& path, uint64_t start_sequence,
+              const std::function<void(uint64_t, std::string_view)>& replay) {
+        path_ = path;
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0 || info.st_size == 0) { // New, or lost before its header was written
+            return create(start_sequence);
+        }
+        uint64_t base_sequence = 0;
+        uint64_t records = 0;
+        size_t valid_end = 0;
+        {
+            Snapshot::File file(path);
+            if (!file.ok()) return fail("cannot read");
+            LogHeader header;
+            if (file.size() < sizeof(header)) return fail("not a command log", false);
+            std::memcpy(&header, file.data(), sizeof(header));
+            if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION ||
+                header.byte_order != Snapshot::BYTE_ORDER_MARK) {
+                return fail("not a command log", false);
+            }
+            base_sequence = header.base_sequence;
+            if (base_sequence > start_sequence) {
+                return fail("starts after the loaded state; load the snapshot it belongs to", false);
+            }
+            size_t position = sizeof(header);
+            while (file.size() - position >= sizeof(RecordHeader)) {
+                RecordHeader record;
+                std::memcpy(&record, file.data() + position, sizeof(record));
+                if (record.length > file.size() - position - sizeof(record)) break; // Torn write
+                std::string_view line(file.data() + position + sizeof(record), record.length);
+                if (record.checksum != checksumOf(line)) break;
+                uint64_t sequence = base_sequence + ++records;
+                if (sequence > start_sequence) replay(sequence, line);
+                position += sizeof(record) + record.length;
+            }
+            valid_end = position;
+            if (valid_end < file.size()) {
+                std::cerr << "command log " << path << ": dropped " << file.size() - valid_end
+                          << " bytes of uncommitted records" << '\n';
+            }
+        }
+        if (base_sequence + records <= start_sequence) { // Everything is in the loaded state already
+            return create(start_sequence);
+        }
+        if (truncate(path.c_str(), static_cast<off_t>(valid_end)) != 0) return fail("cannot truncate");
+        sequence_ = base_sequence + records;
+        return openForAppend() && (fsync(fd_) == 0 || fail("cannot sync"));
+    }
+
+    // Buffers a record; it becomes durable at the next commit()
+    void append(std::string_view line) {
+        RecordHeader record{static_cast<uint32_t>(line.size()), checksumOf(line)};
+        pending_.append(reinterpret_cast<const char*>(&record), sizeof(record));
+        pending_.append(line.data(), line.size());
+        ++pending_records_;
+        ++sequence_;
+    }
+
+    bool groupFull() const { return pending_records_ >= group_size_; }
+    uint64_t sequence() const { return sequence_; }
+    bool ok() const { return !failed_; }
+
+    // Writes the buffered records and waits until they are on disk. Returns false on an
+    // I/O error, after which nothing more may be acknowledged.
+    bool commit() {
+        if (failed_) return false;
+        if (pending_.empty()) return true;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (!writeAll(fd_, pending_.data(), pending_.size())) return fail("cannot write");
+#if defined(__linux__)
+        if (fdatasync(fd_) != 0) return fail("cannot sync");
+#else
+        if (fsync(fd_) != 0) return fail("cannot sync");
+#endif
+        sync_time_ += std::chrono::steady_clock::now() - start;
+        records_ += pending_records_;
+        bytes_ += pending_.size();
+        ++commits_;
+        pending_.clear();
+        pending_records_ = 0;
+        return true;
+    }
+
+    // Starts the log afresh after a snapshot that includes every record so far
+    bool checkpoint() {
+        return commit() && create(sequence_);
+    }
+
+    void report(std::ostream& os) const {
+        os << "wal: " << records_ << " records in " << commits_ << " commits";
+        if (commits_ > 0) {
+            os << " (" << static_cast<double>(records_) / commits_ << " per commit, "
+               << std::chrono::duration<double, std::micro>(sync_time_).count() / commits_ << " us per commit)";
+        }
+        os << ", " << bytes_ << " bytes" << '\n';
+    }
+};
+#else
+// Command logs need POSIX file calls; elsewhere open() always fails
+class CommandLog {
+public:
+    explicit CommandLog(size_t) {}
+    bool open(const std::string&, uint64_t, const std::function<void(uint64_t, std::string_view)>&) {
+        std::cerr << "--wal is not supported on this platform" << '\n';
+        return false;
+    }
+    void append(std::string_view) {}
+    bool groupFull() const { return false; }
+    uint64_t sequence() const { return 0; }
+    bool ok() const { return false; }
+    bool commit() { return false; }
+    bool checkpoint() { return false; }
+    void report(std::ostream&) const {}
+};
+#endif
+
+// State a command touches, as seen by ParallelApplier. Keys name one inventory entry
+// (see WitcherGame::stateKey). A barrier may change the shape of the state (a new item,
+// formula or bestiary entry) or reads a whole category, so it runs alone, after
+// everything before it and before everything after it.
+struct CommandFootprint {
+    bool barrier = false;
+    std::vector<uint64_t> reads;
+    std::vector<uint64_t> writes;
+
+    void clear() {
+        barrier = false;
+        reads.clear();
+        writes.clear();
+    }
+};
+
+// Log-linear latency histogram: exact below 16 ns, then 8 sub-buckets per power of two,
+// so any recorded value is off by at most 1/8. Fixed size, no allocation per sample.
+class LatencyHistogram {
+private:
+    static constexpr size_t SUB_BUCKETS = 8;
+    static constexpr size_t LINEAR_LIMIT = 2 * SUB_BUCKETS; // Values below this get their own bucket
+    static constexpr size_t BUCKET_COUNT = LINEAR_LIMIT + (64 - 4) * SUB_BUCKETS;
+
+    std::array<uint64_t, BUCKET_COUNT> counts_{};
+    uint64_t total_ = 0;
+    uint64_t max_ = 0;
+
+    static size_t bucketOf(uint64_t value) {
+        if (value < LINEAR_LIMIT) return static_cast<size_t>(value);
+        unsigned exponent = 63 - static_cast<unsigned>(__builtin_clzll(value)); // At least 4
+        size_t sub = static_cast<size_t>(value >> (exponent - 3)) & (SUB_BUCKETS - 1);
+        return LINEAR_LIMIT + (exponent - 4) * SUB_BUCKETS + sub;
+    }
+
+    // Largest value that lands in `bucket`
+    static uint64_t upperBound(size_t bucket) {
+        if (bucket < LINEAR_LIMIT) return bucket;
+        unsigned exponent = static_cast<unsigned>((bucket - LINEAR_LIMIT) / SUB_BUCKETS) + 4;
+        uint64_t sub = (bucket - LINEAR_LIMIT) % SUB_BUCKETS;
+        uint64_t width = uint64_t{1} << (exponent - 3);
+        return (uint64_t{1} << exponent) + (sub + 1) * width - 1;
+    }
+
+public:
+    void record(uint64_t value) {
+        ++counts_[bucketOf(value)];
+        ++total_;
+        max_ = std::max(max_, value);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < BUCKET_COUNT; ++i) counts_[i] += other.counts_[i];
+        total_ += other.total_;
+        max_ = std::max(max_, other.max_);
+    }
+
+    uint64_t count() const { return total_; }
+    uint64_t max() const { return max_; }
+
+    // Smallest bucket bound that at least `fraction` of the samples fall under
+    uint64_t percentile(double fraction) const {
+        if (total_ == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(fraction * static_cast<double>(total_));
+        if (rank == 0) rank = 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+            seen += counts_[i];
+            if (seen >= rank) return std::min(upperBound(i), max_);
+        }
+        return max_;
+    }
+};
+
+// Counters kept by BasicEngineStats
+enum class EngineCounter : size_t {
+    INVALID_LINES,        // Lines that are not a command
+    LOOKUP_MISSES,        // Names looked up that the game has never seen
+    BREW_FAILURES,        // Brews without a formula or without enough ingredients
+    ENCOUNTERS_BY_SIGN,   // Encounters won with a sign
+    ENCOUNTERS_BY_POTION, // Encounters won with a potion
+    ENCOUNTERS_ESCAPED,   // Encounters Geralt was unprepared for
+    COUNT
+};
+
+// Engine instrumentation, shown by "Stats?" and --report-stats: parse and execute latency
+// per CommandType, timed by WitcherGame::run, and counters bumped by the command handlers
+// under every executor (relaxed atomics, since --parallel runs handlers concurrently).
+// BasicEngineStats<false> has the same interface and no state, so the calls compile to
+// nothing; defining WITCHER_NO_ENGINE_STATS selects it.
+template <bool Enabled>
+class BasicEngineStats;
+
+template <>
+class BasicEngineStats<true> {
+public:
+    using TimePoint = std::chrono::steady_clock::time_point;
+
+private:
+    struct Latencies {
+        std::array<LatencyHistogram, COMMAND_TYPE_COUNT> parse;
+        std::array<LatencyHistogram, COMMAND_TYPE_COUNT> execute;
+    };
+
+    std::array<std::atomic<unsigned long long>, static_cast<size_t>(EngineCounter::COUNT)> counters_{};
+    std::unique_ptr<Latencies> latencies_; // Allocated by the first timed command, so idle sessions stay small
+
+    static uint64_t nanoseconds(TimePoint from, TimePoint to) {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count());
+    }
+
+    static void printLatency(OutputWriter& out, const char* stage, const LatencyHistogram& histogram) {
+        out << stage << " p50 " << static_cast<long long>(histogram.percentile(0.5))
+            << " ns, p99 " << static_cast<long long>(histogram.percentile(0.99))
+            << " ns, max " << static_cast<long long>(histogram.max()) << " ns";
+    }
+
+public:
+    static TimePoint now() { return std::chrono::steady_clock::now(); }
+
+    void count(EngineCounter counter) {
+        counters_[static_cast<size_t>(counter)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Records one command: parsed between `start` and `parsed`, executed until `executed`
+    void recordCommand(CommandType type, TimePoint start, TimePoint parsed, TimePoint executed) {
+        recordCommand(type, start, parsed, parsed, executed);
+    }
+
+    // Same, for executors that do not execute a command as soon as it is parsed
+    void recordCommand(CommandType type, TimePoint parse_start, TimePoint parse_end,
+                       TimePoint execute_start, TimePoint execute_end) {
+        if (!latencies_) latencies_ = std::make_unique<Latencies>();
+        latencies_->parse[static_cast<size_t>(type)].record(nanoseconds(parse_start, parse_end));
+        latencies_->execute[static_cast<size_t>(type)].record(nanoseconds(execute_start, execute_end));
+    }
+
+    // One line of counters, then one line per command type that was timed
+    void print(OutputWriter& out) const {
+        auto value = [this](EngineCounter counter) {
+            return static_cast<long long>(counters_[static_cast<size_t>(counter)].load(std::memory_order_relaxed));
+        };
+        out << "Stats: " << value(EngineCounter::INVALID_LINES) << " invalid lines, "
+            << value(EngineCounter::LOOKUP_MISSES) << " lookup misses, "
+            << value(EngineCounter::BREW_FAILURES) << " brew failures, encounters won by sign "
+            << value(EngineCounter::ENCOUNTERS_BY_SIGN) << ", by potion "
+            << value(EngineCounter::ENCOUNTERS_BY_POTION) << ", escaped "
+            << value(EngineCounter::ENCOUNTERS_ESCAPED) << '\n';
+        if (!latencies_) return;
+        for (size_t type = 0; type < COMMAND_TYPE_COUNT; ++type) {
+            const LatencyHistogram& parse = latencies_->parse[type];
+            if (parse.count() == 0) continue;
+            out << commandTypeName(static_cast<CommandType>(type)) << ": "
+                << static_cast<long long>(parse.count()) << " commands, ";
+            printLatency(out, "parse", parse);
+            out << "; ";
+            printLatency(out, "execute", latencies_->execute[type]);
+            out << '\n';
+        }
+    }
+};
+
+template <>
+class BasicEngineStats<false> {
+public:
+    struct TimePoint {};
+
+    static TimePoint now() { return {}; }
+    void count(EngineCounter) {}
+    void recordCommand(CommandType, TimePoint, TimePoint, TimePoint) {}
+    void recordCommand(CommandType, TimePoint, TimePoint, TimePoint, TimePoint) {}
+    void print(OutputWriter& out) const { out << "Stats are disabled in this build\n"; }
+};
+
+#ifdef WITCHER_NO_ENGINE_STATS
+using EngineStats = BasicEngineStats<false>;
+#else
+using EngineStats = BasicEngineStats<true>;
+#endif
+
+// Main Game Application Class
+class WitcherGame {
+private:
+    std::unique_ptr<Snapshot::File> snapshot_file_; // Holds names adopted by loadSnapshot; outlives symbols_
+    SymbolTable symbols_; // Shared by the stores below; must be declared before them
+    Inventory inventory_;
+    AlchemyBase alchemy_base_;
+    Bestiary bestiary_;
+    CommandParser parser_;
+    ParseAllocationStats parse_stats_;
+    bool count_parse_allocations_ = false; // Fill parse_stats_ in run(); see countParseAllocations
+    EngineStats stats_;
+    uint64_t log_sequence_ = 0; // Last CommandLog record applied
+
+    // These methods process the data from Parsed::Command objects.
+    // Names that may be stored are interned; names that are only looked up use
+    // lookup(), so queries for unknown names do not grow the table.
+
+    // SymbolTable::find, counting names the game has never seen
+    SymbolId lookup(std::string_view name) {
+        SymbolId id = symbols_.find(name);
+        if (id == INVALID_SYMBOL) stats_.count(EngineCounter::LOOKUP_MISSES);
+        return id;
+    }
+
+    void handleLoot(const Parsed::Command& cmd, OutputWriter& out) {
+        // Safely get the payload using std::get_if
+        if (const auto* payload = std::get_if<Parsed::LootPayload>(&cmd.data)) {
+            for (const auto& item_info : payload->items) {
+                inventory_.addIngredient(symbols_.intern(item_info.name), item_info.quantity);
+            }
+            out << Messages::INGREDIENTS_OBTAINED;
+        } else {
+            // This should not happen if cmd.type is LOOT. Indicates a logic error.
+            out << Messages::INVALID;
+        }
+    }
+
+    void handleTrade(const Parsed::Command& cmd, OutputWriter& out) {
+         if (const auto* payload = std::get_if<Parsed::TradePayload>(&cmd.data)) {
+            // Check if Geralt has enough trophies to trade
             bool can_trade = true;
             for (const auto& trophy_to_give : payload->trophies_to_give) {
-                if (inventory_.getTrophyQuantity(trophy_to_give.name) < trophy_to_give.quantity) {
+                if (inventory_.getTrophyQuantity(lookup(trophy_to_give.name)) < trophy_to_give.quantity) {
                     can_trade = false;
                     break;
                 }
             }
             if (!can_trade) {
-                std::cout << "Not enough trophies" << std::endl;
+                out << Messages::NOT_ENOUGH_TROPHIES;
                 return;
             }
             // Perform the trade: use trophies, add ingredients
             for (const auto& trophy_to_give : payload->trophies_to_give) {
-                if (!inventory_.useTrophy(trophy_to_give.name, trophy_to_give.quantity)) {
+                if (!inventory_.useTrophy(symbols_.find(trophy_to_give.name), trophy_to_give.quantity)) {
                      // This should ideally not happen if the check above passed.
                      return; 
                 }
             }
             for (const auto& ingredient_to_receive : payload->ingredients_to_receive) {
-                inventory_.addIngredient(ingredient_to_receive.name, ingredient_to_receive.quantity);
+                inventory_.addIngredient(symbols_.intern(ingredient_to_receive.name), ingredient_to_receive.quantity);
             }
-            std::cout << "Trade successful" << std::endl;
+            out << Messages::TRADE_SUCCESSFUL;
         } else {
-            std::cout << "INVALID" << std::endl;
+            out << Messages::INVALID;
         }
     }
 
-    void handleBrew(const Parsed::Command& cmd) {
+    void handleBrew(const Parsed::Command& cmd, OutputWriter& out) {
         if (const auto* payload = std::get_if<Parsed::BrewPayload>(&cmd.data)) {
-            const std::string& potion_name = payload->potion_name;
-            const PotionFormula* formula = alchemy_base_.findFormula(potion_name);
+            std::string_view potion_name = payload->potion_name;
+            const PotionFormula* formula = alchemy_base_.findFormula(lookup(potion_name));
             if (!formula) {
-                std::cout << "No formula for " << potion_name << std::endl;
+                stats_.count(EngineCounter::BREW_FAILURES);
+                out << "No formula for " << potion_name << '\n';
                 return;
             }
-            // Check if Geralt has all required ingredients
-            bool has_ingredients = true;
-            for (const auto& req : formula->requirements) {
-                if (inventory_.getIngredientQuantity(req.ingredient_name) < req.quantity) {
-                    has_ingredients = false;
-                    break;
-                }
+            if (payload->batch) {
+                brewBatch(*formula, payload->count, potion_name, out);
+                return;
             }
-            if (!has_ingredients) {
-                std::cout << "Not enough ingredients" << std::endl;
+            // Check if Geralt has all required ingredients
+            if (!inventory_.hasIngredients(formula->compiled)) {
+                stats_.count(EngineCounter::BREW_FAILURES);
+                out << Messages::NOT_ENOUGH_INGREDIENTS;
                 return;
             }
             // Consume ingredients and add potion
-            for (const auto& req : formula->requirements) {
-               if (!inventory_.useIngredient(req.ingredient_name, req.quantity)){
-                     return; 
-               }
+            if (!inventory_.consumeIngredients(formula->compiled)) {
+                return;
             }
-            inventory_.addPotion(potion_name, 1);
-            std::cout << "Alchemy item created: " << potion_name << std::endl;
+            inventory_.addPotion(formula->potion_name, 1);
+            out << "Alchemy item created: " << potion_name << '\n';
         } else {
-             std::cout << "INVALID" << std::endl;
+             out << Messages::INVALID;
         }
     }
 
-    void handleLearnEffectiveness(const Parsed::Command& cmd) {
+    // Brews `count` copies at once (all or nothing), or as many as possible for
+    // BREW_AS_MANY_AS_POSSIBLE, from a single pass over the formula's ingredients
+    void brewBatch(const PotionFormula& formula, int count, std::string_view potion_name, OutputWriter& out) {
+        int available = inventory_.maxBatches(formula.totals);
+        int batches = count == Parsed::BREW_AS_MANY_AS_POSSIBLE ? available : count;
+        if (batches == 0 || batches > available) {
+            stats_.count(EngineCounter::BREW_FAILURES);
+            out << Messages::NOT_ENOUGH_INGREDIENTS;
+            return;
+        }
+        inventory_.consumeBatches(formula.totals, batches);
+        inventory_.addPotion(formula.potion_name, batches);
+        out << "Alchemy items created: " << batches << " " << potion_name << '\n';
+    }
+
+    void handleLearnEffectiveness(const Parsed::Command& cmd, OutputWriter& out) {
         if (const auto* payload = std::get_if<Parsed::LearnEffectivenessPayload>(&cmd.data)) {
-            const std::string& item_name = payload->item_name;
-            const std::string& monster_name = payload->monster_name;
+            std::string_view item_name = payload->item_name;
+            std::string_view monster_name = payload->monster_name;
             EffectivenessType type = payload->item_type;
-            int result_code = bestiary_.addOrUpdateEffectiveness(monster_name, item_name, type);
+            SymbolId item_symbol = symbols_.intern(item_name);
+            uint32_t potion_slot = type == EffectivenessType::POTION ? inventory_.reservePotionSlot(item_symbol) : 0;
+            int result_code = bestiary_.addOrUpdateEffectiveness(symbols_.intern(monster_name), item_symbol, type, potion_slot);
             switch (result_code) {
-                case 2: std::cout << "New bestiary entry added: " << monster_name << std::endl; break;
-                case 1: std::cout << "Bestiary entry updated: " << monster_name << std::endl; break;
-                case 0: std::cout << "Already known effectiveness" << std::endl; break;
-                case -1: std::cout << "INVALID" << std::endl; break;
-                default: std::cout << "INVALID" << std::endl; break; // Should not be hit
+                case 2: out << "New bestiary entry added: " << monster_name << '\n'; break;
+                case 1: out << "Bestiary entry updated: " << monster_name << '\n'; break;
+                case 0: out << Messages::ALREADY_KNOWN_EFFECTIVENESS; break;
+                default: out << Messages::INVALID; break; // Should not be hit
             }
         } else {
-            std::cout << "INVALID" << std::endl;
+            out << Messages::INVALID;
         }
     }
 
-    void handleLearnFormula(const Parsed::Command& cmd) {
+    void handleLearnFormula(const Parsed::Command& cmd, OutputWriter& out) {
         if (const auto* payload = std::get_if<Parsed::LearnFormulaPayload>(&cmd.data)) {
-            const std::string& potion_name = payload->potion_name;
+            std::string_view potion_name = payload->potion_name;
+            SymbolId potion_symbol = symbols_.intern(potion_name);
             // First, check if formula is already known
-            if (alchemy_base_.findFormula(potion_name) != nullptr) {
-                std::cout << "Already known formula" << std::endl;
+            if (alchemy_base_.findFormula(potion_symbol) != nullptr) {
+                out << Messages::ALREADY_KNOWN_FORMULA;
                 return;
             }
 
             std::vector<IngredientRequirement> reqs_cpp; // This is WitcherGame's IngredientRequirement
+            std::vector<SlotRequirement> slots; // The same requirements compiled to inventory slots
             // Convert Parsed::ItemInfo to IngredientRequirement
             for (const auto& parsed_req : payload->requirements) {
-                reqs_cpp.emplace_back(parsed_req.name, parsed_req.quantity);
+                SymbolId ingredient = symbols_.intern(parsed_req.name);
+                reqs_cpp.emplace_back(ingredient, parsed_req.quantity);
+                slots.push_back({inventory_.reserveIngredientSlot(ingredient), parsed_req.quantity});
             }
 
-            bool success = alchemy_base_.addFormula(potion_name, reqs_cpp);
+            bool success = alchemy_base_.addFormula(potion_symbol, reqs_cpp, std::move(slots), inventory_);
             if (success) {
-                std::cout << "New alchemy formula obtained: " << potion_name << std::endl;
+                out << "New alchemy formula obtained: " << potion_name << '\n';
             } else {
-                std::cout << "INVALID" << std::endl;
+                out << Messages::INVALID;
             }
         } else {
-             std::cout << "INVALID" << std::endl;
+             out << Messages::INVALID;
         }
     }
 
-    void handleEncounter(const Parsed::Command& cmd) {
+    void handleEncounter(const Parsed::Command& cmd, OutputWriter& out) {
         if (const auto* payload = std::get_if<Parsed::EncounterPayload>(&cmd.data)) {
-            const std::string& monster_name = payload->monster_name;
-            const BestiaryEntry* entry = bestiary_.findEntry(monster_name);
+            std::string_view monster_name = payload->monster_name;
+            const BestiaryEntry* entry = bestiary_.findEntry(lookup(monster_name));
             bool success = false;
             bool potion_to_use_on_success = false;
-            std::string effective_potion_name;
+            uint32_t effective_potion_slot = 0;
 
             if (entry) {
                 // Check signs first
-                for (const auto& eff_item : entry->effective_items) {
-                    if (eff_item.type == EffectivenessType::SIGN) {
-                        success = true;
-                        break;
-                    }
-                }
-                // If no sign worked, check potions
+                success = entry->has_sign;
+                // If no sign worked, use the first effective potion (in learn order) in stock
                 if (!success) {
-                    for (const auto& eff_item : entry->effective_items) {
-                        if (eff_item.type == EffectivenessType::POTION) {
-                            if (inventory_.getPotionQuantity(eff_item.name) > 0) { // Check if potion is available
-                                success = true;
-                                potion_to_use_on_success = true;
-                                effective_potion_name = eff_item.name;
-                                break;
-                            }
+                    for (uint32_t slot : entry->potion_slots) {
+                        if (inventory_.potionQuantityAt(slot) > 0) {
+                            success = true;
+                            potion_to_use_on_success = true;
+                            effective_potion_slot = slot;
+                            break;
                         }
                     }
                 }
             }
 
             if (success) {
-                std::cout << "Geralt defeats " << monster_name << std::endl;
-                if (potion_to_use_on_success && !effective_potion_name.empty()) {
-                    if (!inventory_.usePotion(effective_potion_name, 1)) {
-                         std::cout << "INVALID" << std::endl;
+                stats_.count(potion_to_use_on_success ? EngineCounter::ENCOUNTERS_BY_POTION : EngineCounter::ENCOUNTERS_BY_SIGN);
+                out << "Geralt defeats " << monster_name << '\n';
+                if (potion_to_use_on_success) {
+                    if (!inventory_.usePotionAt(effective_potion_slot, 1)) {
+                         out << Messages::INVALID;
                     }
                 }
-                inventory_.addTrophy(monster_name, 1); // Add monster trophy
+                inventory_.addTrophy(symbols_.intern(monster_name), 1); // Add monster trophy
             } else {
-                std::cout << "Geralt is unprepared and barely escapes with his life" << std::endl;
+                stats_.count(EngineCounter::ENCOUNTERS_ESCAPED);
+                out << Messages::UNPREPARED;
             }
         } else {
-            std::cout << "INVALID" << std::endl;
+            out << Messages::INVALID;
         }
     }
 
-    void handleQueryTotalSpecific(const Parsed::Command& cmd) {
+    void handleQueryTotalSpecific(const Parsed::Command& cmd, OutputWriter& out) {
         if (const auto* payload = std::get_if<Parsed::QueryTotalSpecificPayload>(&cmd.data)) {
-            const std::string& category = payload->category;
-            const std::string& item_name = payload->item_name;
+            std::string_view category = payload->category;
+            SymbolId item_name = lookup(payload->item_name); // Unknown names have quantity 0
             int quantity = 0;
             if (category == "ingredient") {
                 quantity = inventory_.getIngredientQuantity(item_name);
@@ -1215,95 +3260,2747 @@ private:
             } else if (category == "trophy") {
                 quantity = inventory_.getTrophyQuantity(item_name);
             } else {
-                std::cout << "INVALID" << std::endl; // Should be caught by parser ideally
+                out << Messages::INVALID; // Should be caught by parser ideally
                 return;
             }
-            std::cout << quantity << std::endl;
+            out << quantity << '\n';
         } else {
-             std::cout << "INVALID" << std::endl;
+             out << Messages::INVALID;
         }
     }
 
-    void handleQueryTotalAll(const Parsed::Command& cmd) {
+    void handleQueryTotalAll(const Parsed::Command& cmd, OutputWriter& out) {
         if (const auto* payload = std::get_if<Parsed::QueryTotalAllPayload>(&cmd.data)) {
-            const std::string& category = payload->category;
+            std::string_view category = payload->category;
             if (category == "ingredient") {
-                inventory_.printAllIngredients();
+                inventory_.printAllIngredients(out);
             } else if (category == "potion") {
-                inventory_.printAllPotions();
+                inventory_.printAllPotions(out);
             } else if (category == "trophy") {
-                inventory_.printAllTrophies();
+                inventory_.printAllTrophies(out);
             } else {
-                std::cout << "INVALID" << std::endl; // Parser should catch invalid categories
+                out << Messages::INVALID; // Parser should catch invalid categories
             }
         } else {
-            std::cout << "INVALID" << std::endl;
+            out << Messages::INVALID;
         }
     }
 
-    void handleQueryEffectiveAgainst(const Parsed::Command& cmd) {
+    void handleQueryEffectiveAgainst(const Parsed::Command& cmd, OutputWriter& out) {
         if (const auto* payload = std::get_if<Parsed::QueryEffectiveAgainstPayload>(&cmd.data)) {
-            const std::string& monster_name = payload->monster_name;
-            bestiary_.printEffectivenessForMonster(monster_name);
+            std::string_view monster_name = payload->monster_name;
+            bestiary_.printEffectivenessForMonster(out, lookup(monster_name), monster_name);
         } else {
-            std::cout << "INVALID" << std::endl;
+            out << Messages::INVALID;
         }
     }
 
-    void handleQueryWhatIsIn(const Parsed::Command& cmd) {
+    void handleQueryItemEffectiveAgainst(const Parsed::Command& cmd, OutputWriter& out) {
+        if (const auto* payload = std::get_if<Parsed::QueryItemEffectiveAgainstPayload>(&cmd.data)) {
+            std::string_view item_name = payload->item_name;
+            bestiary_.printMonstersForItem(out, lookup(item_name), item_name);
+        } else {
+            out << Messages::INVALID;
+        }
+    }
+
+    void handleQueryWhatIsIn(const Parsed::Command& cmd, OutputWriter& out) {
         if (const auto* payload = std::get_if<Parsed::QueryWhatIsInPayload>(&cmd.data)) {
-            const std::string& potion_name = payload->potion_name;
-            alchemy_base_.printFormulaForPotion(potion_name);
+            std::string_view potion_name = payload->potion_name;
+            alchemy_base_.printFormulaForPotion(out, lookup(potion_name), potion_name);
         } else {
-            std::cout << "INVALID" << std::endl;
+            out << Messages::INVALID;
         }
     }
 
+    void handleQueryWhatCanBrew(OutputWriter& out) {
+        alchemy_base_.printBrewable(out);
+    }
+
 public:
-    WitcherGame() = default;
+    WitcherGame() : inventory_(symbols_), alchemy_base_(symbols_), bestiary_(symbols_) {
+        inventory_.setIngredientObserver(&alchemy_base_);
+    }
 
-    // Main game loop
-    void run() {
-        std::string line_str;
-        while (true) {
-            std::cout << ">> " << std::flush; // Prompt
+    const ParseAllocationStats& parseStats() const { return parse_stats_; }
 
-            if (!std::getline(std::cin, line_str)) { // Read a line of input
-                if (std::cin.eof()) { // End of file (e.g., Ctrl+D)
-                    break; 
-                }
-            }
+    // Latency of one command timed by an executor other than run(). The histograms are not
+    // thread-safe, so executors record from one thread only (their applier or caller).
+    void recordTiming(CommandType type, EngineStats::TimePoint parse_start, EngineStats::TimePoint parse_end,
+                      EngineStats::TimePoint execute_start, EngineStats::TimePoint execute_end) {
+        stats_.recordCommand(type, parse_start, parse_end, execute_start, execute_end);
+    }
 
-            Parsed::Command cmd = parser_.parse(line_str); // Parse the input line
+    // Makes run() read AllocationCounter around each parse; only has an effect in
+    // builds that define WITCHER_COUNT_ALLOCATIONS
+    void countParseAllocations(bool enabled) { count_parse_allocations_ = enabled; }
+    const EngineStats& stats() const { return stats_; }
+
+    // The game's state as the contents of a snapshot file (see Snapshot)
+    std::string snapshotBytes() const {
+        using namespace Snapshot;
+        std::vector<StringRecord> strings;
+        std::string string_bytes;
+        strings.reserve(symbols_.size());
+        for (SymbolId id = 0; id < symbols_.size(); ++id) {
+            std::string_view name = symbols_.name(id);
+            strings.push_back(StringRecord{string_bytes.size(), static_cast<uint32_t>(name.size()), 0});
+            string_bytes += name;
+        }
 
-            if (cmd.type == CommandType::EXIT) {
-                break; // Exit the loop
+        auto items = [](const SlabPool<InventoryItem>& pool) {
+            std::vector<ItemRecord> records;
+            for (uint32_t slot = 0; slot < pool.size(); ++slot) {
+                records.push_back(ItemRecord{pool[slot].name, pool[slot].quantity});
             }
-
-            // Dispatch to the appropriate handler based on command type
-            switch (cmd.type) {
-                case CommandType::LOOT:                  handleLoot(cmd); break;
-                case CommandType::TRADE:                 handleTrade(cmd); break;
-                case CommandType::BREW:                  handleBrew(cmd); break;
-                case CommandType::LEARN_EFFECTIVENESS:   handleLearnEffectiveness(cmd); break;
-                case CommandType::LEARN_FORMULA:         handleLearnFormula(cmd); break;
-                case CommandType::ENCOUNTER:             handleEncounter(cmd); break;
-                case CommandType::QUERY_TOTAL_SPECIFIC:  handleQueryTotalSpecific(cmd); break;
-                case CommandType::QUERY_TOTAL_ALL:       handleQueryTotalAll(cmd); break;
-                case CommandType::QUERY_EFFECTIVE_AGAINST: handleQueryEffectiveAgainst(cmd); break;
-                case CommandType::QUERY_WHAT_IS_IN:      handleQueryWhatIsIn(cmd); break;
-                case CommandType::EMPTY:                 break; // Do nothing for empty lines
-                case CommandType::INVALID:
-                default:
-                    std::cout << "INVALID" << std::endl;
+            return records;
+        };
+
+        std::vector<FormulaRecord> formulas;
+        std::vector<RequirementRecord> requirements;
+        const SlabPool<PotionFormula>& formula_pool = alchemy_base_.formulae();
+        for (uint32_t slot = 0; slot < formula_pool.size(); ++slot) {
+            const PotionFormula& formula = formula_pool[slot];
+            formulas.push_back(FormulaRecord{formula.potion_name, static_cast<uint32_t>(requirements.size()),
+                                             static_cast<uint32_t>(formula.requirements.size()), 0});
+            for (const IngredientRequirement& req : formula.requirements) {
+                requirements.push_back(RequirementRecord{req.ingredient_name, req.quantity});
+            }
+        }
+
+        std::vector<EntryRecord> entries;
+        std::vector<EffectiveRecord> effective_items;
+        const SlabPool<BestiaryEntry>& entry_pool = bestiary_.entries();
+        for (uint32_t slot = 0; slot < entry_pool.size(); ++slot) {
+            const BestiaryEntry& entry = entry_pool[slot];
+            entries.push_back(EntryRecord{entry.monster_name, static_cast<uint32_t>(effective_items.size()),
+                                          static_cast<uint32_t>(entry.effective_items.size()), 0});
+            for (const EffectiveItem& item : entry.effective_items) {
+                effective_items.push_back(EffectiveRecord{item.name, static_cast<uint32_t>(item.type)});
+            }
+        }
+
+        // The name bytes go first so that STRINGS can hold their file offsets
+        Builder builder;
+        uint64_t bytes_offset = builder.addSection(STRING_BYTES, string_bytes.data(), string_bytes.size(), string_bytes.size());
+        for (StringRecord& record : strings) record.offset += bytes_offset;
+        builder.addSection(STRINGS, strings);
+        builder.addSection(INGREDIENTS, items(inventory_.ingredientSlots()));
+        builder.addSection(POTIONS, items(inventory_.potionSlots()));
+        builder.addSection(TROPHIES, items(inventory_.trophySlots()));
+        builder.addSection(FORMULAS, formulas);
+        builder.addSection(REQUIREMENTS, requirements);
+        builder.addSection(ENTRIES, entries);
+        builder.addSection(EFFECTIVE_ITEMS, effective_items);
+        return builder.finish(log_sequence_);
+    }
+
+    // Writes the game's state to `path`. Returns false if the file could not be written.
+    bool saveSnapshot(const std::string& path) const {
+        if (!Snapshot::writeFile(path, snapshotBytes())) {
+            std::cerr << "cannot write snapshot " << path << ": " << std::strerror(errno) << '\n';
+            return false;
+        }
+        return true;
+    }
+
+    // Replaces the state of a game that has not run any command yet with the snapshot at
+    // `path`. Names stay in the mapped file, which the game keeps until it is destroyed.
+    // Returns false, after saying why, if the file is missing or malformed; the game must
+    // then be discarded.
+    bool loadSnapshot(const std::string& path) {
+        return loadSnapshot(std::make_unique<Snapshot::File>(path), path);
+    }
+
+    // As above, from a snapshot already in memory; `source` names it in error messages
+    bool loadSnapshot(std::unique_ptr<Snapshot::File> file, const std::string& source) {
+        using namespace Snapshot;
+        auto fail = [&source](const char* reason) {
+            std::cerr << "cannot load snapshot " << source << ": " << reason << '\n';
+            return false;
+        };
+        if (symbols_.size() != 0) return fail("the game already has state");
+        if (!file->ok()) return fail("cannot open or map the file");
+        if (file->size() < sizeof(Header)) return fail("file too short");
+        Header header;
+        std::memcpy(&header, file->data(), sizeof(Header));
+        if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) return fail("not a snapshot");
+        if (header.byte_order != BYTE_ORDER_MARK) return fail("written on a host with a different byte order");
+        if (header.version != VERSION) return fail("unsupported version");
+        if (header.file_size != file->size()) return fail("file size does not match its header");
+        if (header.checksum != checksum(file->data() + sizeof(Header), file->size() - sizeof(Header))) {
+            return fail("checksum mismatch");
+        }
+
+        const StringRecord* strings = records<StringRecord>(*file, header, STRINGS);
+        const ItemRecord* item_sections[] = {records<ItemRecord>(*file, header, INGREDIENTS),
+                                             records<ItemRecord>(*file, header, POTIONS),
+                                             records<ItemRecord>(*file, header, TROPHIES)};
+        const FormulaRecord* formulas = records<FormulaRecord>(*file, header, FORMULAS);
+        const RequirementRecord* requirements = records<RequirementRecord>(*file, header, REQUIREMENTS);
+        const EntryRecord* entries = records<EntryRecord>(*file, header, ENTRIES);
+        const EffectiveRecord* effective_items = records<EffectiveRecord>(*file, header, EFFECTIVE_ITEMS);
+        if (!strings || !item_sections[0] || !item_sections[1] || !item_sections[2] || !formulas || !requirements ||
+            !entries || !effective_items) {
+            return fail("section out of bounds");
+        }
+
+        uint64_t symbol_count = header.sections[STRINGS].count;
+        for (uint64_t i = 0; i < symbol_count; ++i) {
+            const StringRecord& record = strings[i];
+            if (record.offset > file->size() || record.length > file->size() - record.offset || record.length == 0) {
+                return fail("name out of bounds");
+            }
+            if (!symbols_.adopt(std::string_view(file->data() + record.offset, record.length))) {
+                return fail("duplicate name");
+            }
+        }
+
+        // Items first: formulas and bestiary entries refer to their slots
+        for (size_t category = 0; category < 3; ++category) {
+            const ItemRecord* items = item_sections[category];
+            for (uint64_t i = 0; i < header.sections[INGREDIENTS + category].count; ++i) {
+                if (items[i].name >= symbol_count || items[i].quantity < 0) return fail("bad item record");
+                bool restored = category == 0 ? inventory_.restoreIngredient(items[i].name, items[i].quantity)
+                              : category == 1 ? inventory_.restorePotion(items[i].name, items[i].quantity)
+                                              : inventory_.restoreTrophy(items[i].name, items[i].quantity);
+                if (!restored) return fail("duplicate item");
+            }
+        }
+
+        std::vector<IngredientRequirement> reqs;
+        std::vector<SlotRequirement> slots;
+        for (uint64_t i = 0; i < header.sections[FORMULAS].count; ++i) {
+            const FormulaRecord& record = formulas[i];
+            if (record.potion >= symbol_count || alchemy_base_.findFormula(record.potion) ||
+                record.first_requirement > header.sections[REQUIREMENTS].count ||
+                record.requirement_count > header.sections[REQUIREMENTS].count - record.first_requirement) {
+                return fail("bad formula record");
+            }
+            reqs.clear();
+            slots.clear();
+            for (uint32_t r = 0; r < record.requirement_count; ++r) {
+                const RequirementRecord& req = requirements[record.first_requirement + r];
+                if (req.ingredient >= symbol_count || req.quantity <= 0) return fail("bad requirement record");
+                reqs.emplace_back(req.ingredient, req.quantity);
+                slots.push_back(SlotRequirement{inventory_.reserveIngredientSlot(req.ingredient), req.quantity});
+            }
+            if (!alchemy_base_.addFormula(record.potion, reqs, slots, inventory_)) return fail("bad formula record");
+        }
+
+        bestiary_.reserveForRestore(header.sections[EFFECTIVE_ITEMS].count);
+        for (uint64_t i = 0; i < header.sections[ENTRIES].count; ++i) {
+            const EntryRecord& record = entries[i];
+            if (record.monster >= symbol_count || bestiary_.findEntry(record.monster) || record.item_count == 0 ||
+                record.first_item > header.sections[EFFECTIVE_ITEMS].count ||
+                record.item_count > header.sections[EFFECTIVE_ITEMS].count - record.first_item) {
+                return fail("bad bestiary record");
+            }
+            for (uint32_t e = 0; e < record.item_count; ++e) {
+                const EffectiveRecord& item = effective_items[record.first_item + e];
+                if (item.item >= symbol_count || item.type > static_cast<uint32_t>(EffectivenessType::SIGN)) {
+                    return fail("bad effectiveness record");
+                }
+                EffectivenessType type = static_cast<EffectivenessType>(item.type);
+                uint32_t potion_slot = type == EffectivenessType::POTION ? inventory_.reservePotionSlot(item.item) : 0;
+                if (!bestiary_.restoreEffectiveness(record.monster, item.item, type, potion_slot)) {
+                    return fail("duplicate effectiveness");
+                }
+            }
+        }
+        bestiary_.rebuildItemIndex();
+        log_sequence_ = header.log_sequence;
+        snapshot_file_ = std::move(file);
+        return true;
+    }
+
+
+    // Kinds of state keys used by describe()
+    enum class StateKind : uint64_t { INGREDIENT = 1, POTION = 2, TROPHY = 3 };
+
+    static uint64_t stateKey(StateKind kind, SymbolId id) {
+        return (static_cast<uint64_t>(kind) << 32) | id;
+    }
+
+    // Fills `footprint` with what executing `cmd` in the current state would touch.
+    // Only existing items are keyed; anything that could create one is a barrier.
+    void describe(const Parsed::Command& cmd, CommandFootprint& footprint) const {
+        footprint.clear();
+        switch (cmd.type) {
+            case CommandType::LOOT:
+                if (const auto* payload = std::get_if<Parsed::LootPayload>(&cmd.data)) {
+                    for (const auto& item : payload->items) {
+                        SymbolId id = symbols_.find(item.name);
+                        if (!inventory_.containsIngredient(id)) footprint.barrier = true;
+                        footprint.writes.push_back(stateKey(StateKind::INGREDIENT, id));
+                    }
+                }
+                break;
+            case CommandType::TRADE:
+                if (const auto* payload = std::get_if<Parsed::TradePayload>(&cmd.data)) {
+                    for (const auto& trophy : payload->trophies_to_give) {
+                        footprint.writes.push_back(stateKey(StateKind::TROPHY, symbols_.find(trophy.name)));
+                    }
+                    for (const auto& item : payload->ingredients_to_receive) {
+                        SymbolId id = symbols_.find(item.name);
+                        if (!inventory_.containsIngredient(id)) footprint.barrier = true;
+                        footprint.writes.push_back(stateKey(StateKind::INGREDIENT, id));
+                    }
+                }
+                break;
+            case CommandType::BREW:
+                if (const auto* payload = std::get_if<Parsed::BrewPayload>(&cmd.data)) {
+                    const PotionFormula* formula = alchemy_base_.findFormula(symbols_.find(payload->potion_name));
+                    if (!formula) break; // Only prints "No formula"
+                    if (!inventory_.containsPotion(formula->potion_name)) footprint.barrier = true;
+                    footprint.writes.push_back(stateKey(StateKind::POTION, formula->potion_name));
+                    for (const auto& req : formula->requirements) {
+                        footprint.writes.push_back(stateKey(StateKind::INGREDIENT, req.ingredient_name));
+                    }
+                }
+                break;
+            case CommandType::ENCOUNTER:
+                if (const auto* payload = std::get_if<Parsed::EncounterPayload>(&cmd.data)) {
+                    SymbolId monster = symbols_.find(payload->monster_name);
+                    const BestiaryEntry* entry = bestiary_.findEntry(monster);
+                    if (!entry) break; // Only prints the escape message
+                    if (!inventory_.containsTrophy(monster)) footprint.barrier = true;
+                    footprint.writes.push_back(stateKey(StateKind::TROPHY, monster));
+                    if (!entry->has_sign) { // Any of the potions may be the one used
+                        for (const auto& item : entry->effective_items) {
+                            if (item.type == EffectivenessType::POTION) {
+                                footprint.writes.push_back(stateKey(StateKind::POTION, item.name));
+                            }
+                        }
+                    }
+                }
+                break;
+            case CommandType::QUERY_TOTAL_SPECIFIC:
+                if (const auto* payload = std::get_if<Parsed::QueryTotalSpecificPayload>(&cmd.data)) {
+                    SymbolId id = symbols_.find(payload->item_name);
+                    if (payload->category == "ingredient") footprint.reads.push_back(stateKey(StateKind::INGREDIENT, id));
+                    else if (payload->category == "potion") footprint.reads.push_back(stateKey(StateKind::POTION, id));
+                    else if (payload->category == "trophy") footprint.reads.push_back(stateKey(StateKind::TROPHY, id));
+                }
+                break;
+            case CommandType::LEARN_EFFECTIVENESS:  // Bestiary, reverse index and potion slots
+            case CommandType::LEARN_FORMULA:        // Formulas, ingredient slots and the brewable set
+            case CommandType::QUERY_TOTAL_ALL:      // Reads every item of a category
+            case CommandType::QUERY_WHAT_CAN_BREW:  // Reads every formula's stock
+            case CommandType::QUERY_STATS:          // Reads the counters every command bumps
+                footprint.barrier = true;
+                break;
+            default: // The other queries read data that only learns change; the rest only print
+                break;
+        }
+    }
+
+    // Applies one parsed command (other than EXIT) and writes its response to `out`
+    void execute(const Parsed::Command& cmd, OutputWriter& out) {
+        switch (cmd.type) {
+            case CommandType::LOOT:                  handleLoot(cmd, out); break;
+            case CommandType::TRADE:                 handleTrade(cmd, out); break;
+            case CommandType::BREW:                  handleBrew(cmd, out); break;
+            case CommandType::LEARN_EFFECTIVENESS:   handleLearnEffectiveness(cmd, out); break;
+            case CommandType::LEARN_FORMULA:         handleLearnFormula(cmd, out); break;
+            case CommandType::ENCOUNTER:             handleEncounter(cmd, out); break;
+            case CommandType::QUERY_TOTAL_SPECIFIC:  handleQueryTotalSpecific(cmd, out); break;
+            case CommandType::QUERY_TOTAL_ALL:       handleQueryTotalAll(cmd, out); break;
+            case CommandType::QUERY_EFFECTIVE_AGAINST: handleQueryEffectiveAgainst(cmd, out); break;
+            case CommandType::QUERY_ITEM_EFFECTIVE_AGAINST: handleQueryItemEffectiveAgainst(cmd, out); break;
+            case CommandType::QUERY_WHAT_IS_IN:      handleQueryWhatIsIn(cmd, out); break;
+            case CommandType::QUERY_WHAT_CAN_BREW:   handleQueryWhatCanBrew(out); break;
+            case CommandType::QUERY_STATS:           stats_.print(out); break;
+            case CommandType::EMPTY:                 break; // Do nothing for empty lines
+            case CommandType::EXIT:                  break; // The caller ends the session
+            case CommandType::INVALID:
+            default:
+                stats_.count(EngineCounter::INVALID_LINES);
+                out << Messages::INVALID;
+                break;
+        }
+    }
+
+    // True for the commands that change state, which are the ones a CommandLog records
+    static bool isLogged(CommandType type) {
+        switch (type) {
+            case CommandType::LOOT:
+            case CommandType::TRADE:
+            case CommandType::BREW:
+            case CommandType::LEARN_EFFECTIVENESS:
+            case CommandType::LEARN_FORMULA:
+            case CommandType::ENCOUNTER:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    uint64_t logSequence() const { return log_sequence_; }
+
+    // Re-applies a CommandLog record during recovery; its response was delivered before
+    void applyLogged(std::string_view line, uint64_t sequence) {
+        OutputWriter discard = OutputWriter::discard();
+        execute(parser_.parseInPlace(line), discard);
+        parser_.endBatch();
+        log_sequence_ = sequence;
+    }
+
+    // Applies one line of a recorded session for ReplayEngine. Only state-changing commands
+    // run, since every response is discarded. Returns false for "Exit", which ends the session.
+    bool replayLine(std::string_view line) {
+        Parsed::Command cmd = parser_.parseInPlace(line);
+        bool more = cmd.type != CommandType::EXIT;
+        if (isLogged(cmd.type)) {
+            OutputWriter discard = OutputWriter::discard();
+            execute(cmd, discard);
+        }
+        parser_.endBatch();
+        return more;
+    }
+
+    // Main game loop. Interactive mode prompts before each line and flushes, which also
+    // delivers the previous answer; batch mode lets `out` write only when its buffer fills.
+    // With a command log, state-changing lines are appended to it before they run, and
+    // responses are held back until their records are committed: after every line when
+    // interactive, otherwise whenever the log's group fills. Stops if the log fails.
+    void run(InputSource& input, OutputWriter& out, bool interactive, CommandLog* log = nullptr) {
+        OutputWriter held = OutputWriter::toMemory();
+        OutputWriter& responses = log ? held : out;
+        auto acknowledge = [&] {
+            if (!log->commit()) return false;
+            out << held.contents();
+            held.clear();
+            return true;
+        };
+        std::string_view line_str;
+        while (true) {
+            if (interactive) {
+                out << Messages::PROMPT;
+                out.flush();
+            }
+
+            if (!input.nextLine(line_str)) { // Read a line of input
+                break; // End of input (e.g., Ctrl+D)
+            }
+
+            bool count_allocations = AllocationCounter::enabled && count_parse_allocations_;
+            unsigned long long allocations_before = count_allocations ? AllocationCounter::current() : 0;
+            EngineStats::TimePoint start = EngineStats::now();
+            Parsed::Command cmd = parser_.parseInPlace(line_str); // The line outlives the command
+            EngineStats::TimePoint parsed = EngineStats::now();
+            if (count_allocations) {
+                parse_stats_.recordParse(AllocationCounter::current() - allocations_before);
+            }
+
+            if (cmd.type == CommandType::EXIT) {
+                break; // Exit the loop
+            }
+
+            if (log && isLogged(cmd.type)) {
+                log->append(line_str);
+                log_sequence_ = log->sequence();
+            }
+            execute(cmd, responses); // Every line is its own parse batch here
+            stats_.recordCommand(cmd.type, start, parsed, EngineStats::now());
+            parser_.endBatch(); // Before the next nextLine() replaces the line
+            if (log && (interactive || log->groupFull()) && !acknowledge()) {
+                break;
+            }
+        }
+        if (log) {
+            acknowledge();
+        }
+        out.flush();
+    }
+};
+
+// Optional three-stage executor for batch runs (--pipeline N):
+//   reader thread -> N parser threads -> applier (the calling thread).
+// Line s goes to lane s % N. Each lane is a ring of slots that moves through the stages
+// in order, tracked by three counters with one writer each: `filled` (reader), `parsed`
+// (that lane's parser) and `applied` (applier). The applier visits the lanes round-robin,
+// so commands run in input order on a single thread and the output is identical to run().
+class CommandPipeline {
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Slot {
+        uint64_t sequence = 0;       // Input line number, checked by the applier
+        std::string_view line;       // Into the input, or copied into `arena`
+        LineArena arena{GameConstants::PIPELINE_SLOT_ARENA_SIZE}; // Line copy and item lists
+        Parsed::Command command;
+        EngineStats::TimePoint parse_start{}; // Set by the parser, for WitcherGame::recordTiming
+        EngineStats::TimePoint parse_end{};
+    };
+
+    struct Lane {
+        std::unique_ptr<Slot[]> slots;
+        alignas(64) std::atomic<uint64_t> filled{0};
+        alignas(64) std::atomic<uint64_t> parsed{0};
+        alignas(64) std::atomic<uint64_t> applied{0};
+        Clock::duration parser_wait{}; // Written by the lane's parser, read after join
+        unsigned long long parsed_lines = 0;
+    };
+
+    size_t lane_count_;
+    size_t capacity_;
+    std::unique_ptr<Lane[]> lanes_;
+    std::atomic<bool> input_done_{false}; // Reader has filled its last slot
+    std::atomic<bool> stop_{false};       // Applier saw EXIT; everyone else winds down
+    uint64_t line_count_ = 0;             // Lines read; final once input_done_ is set
+
+    // Statistics, each written by one stage and read after the threads are joined
+    Clock::duration reader_wait_{};
+    Clock::duration applier_wait_{};
+    unsigned long long applied_lines_ = 0;
+    unsigned long long occupancy_sum_ = 0; // Slots in flight in a lane, sampled per applied line
+    uint64_t occupancy_max_ = 0;
+    Clock::duration elapsed_{};
+
+    // Spins briefly, then yields; most waits are short and cores may be oversubscribed
+    static void pause(unsigned& spins) {
+        if (++spins < 64) return;
+        std::this_thread::yield();
+    }
+
+    void readerLoop(InputSource& input) {
+        bool copy_lines = !input.linesOutliveSource();
+        std::string_view line;
+        uint64_t sequence = 0;
+        while (!stop_.load(std::memory_order_relaxed) && input.nextLine(line)) {
+            Lane& lane = lanes_[sequence % lane_count_];
+            uint64_t index = lane.filled.load(std::memory_order_relaxed);
+            if (index - lane.applied.load(std::memory_order_acquire) >= capacity_) { // Ring full
+                Clock::time_point wait_start = Clock::now();
+                unsigned spins = 0;
+                while (index - lane.applied.load(std::memory_order_acquire) >= capacity_) {
+                    if (stop_.load(std::memory_order_relaxed)) return finishInput(sequence);
+                    pause(spins);
+                }
+                reader_wait_ += Clock::now() - wait_start;
+            }
+            Slot& slot = lane.slots[index % capacity_];
+            slot.sequence = sequence;
+            slot.arena.reset();
+            slot.line = copy_lines ? slot.arena.copy(line) : line;
+            lane.filled.store(index + 1, std::memory_order_release);
+            ++sequence;
+        }
+        finishInput(sequence);
+    }
+
+    void finishInput(uint64_t sequence) {
+        line_count_ = sequence;
+        input_done_.store(true, std::memory_order_release);
+    }
+
+    void parserLoop(Lane& lane) {
+        uint64_t index = 0;
+        while (true) {
+            if (index == lane.filled.load(std::memory_order_acquire)) {
+                Clock::time_point wait_start = Clock::now();
+                unsigned spins = 0;
+                while (index == lane.filled.load(std::memory_order_acquire)) {
+                    if (stop_.load(std::memory_order_relaxed)) return;
+                    if (input_done_.load(std::memory_order_acquire) &&
+                        index == lane.filled.load(std::memory_order_acquire)) {
+                        lane.parser_wait += Clock::now() - wait_start;
+                        return;
+                    }
+                    pause(spins);
+                }
+                lane.parser_wait += Clock::now() - wait_start;
+            }
+            Slot& slot = lane.slots[index % capacity_];
+            slot.parse_start = EngineStats::now();
+            slot.command = parse_command_internal(slot.line, slot.arena);
+            slot.parse_end = EngineStats::now();
+            lane.parsed.store(++index, std::memory_order_release);
+            ++lane.parsed_lines;
+        }
+    }
+
+    void applierLoop(WitcherGame& game, OutputWriter& out) {
+        for (uint64_t sequence = 0;; ++sequence) {
+            Lane& lane = lanes_[sequence % lane_count_];
+            uint64_t index = lane.applied.load(std::memory_order_relaxed);
+            if (index == lane.parsed.load(std::memory_order_acquire)) {
+                Clock::time_point wait_start = Clock::now();
+                unsigned spins = 0;
+                while (index == lane.parsed.load(std::memory_order_acquire)) {
+                    if (input_done_.load(std::memory_order_acquire) && sequence == line_count_) {
+                        applier_wait_ += Clock::now() - wait_start;
+                        return; // Every line has been applied
+                    }
+                    pause(spins);
+                }
+                applier_wait_ += Clock::now() - wait_start;
+            }
+            uint64_t in_flight = lane.filled.load(std::memory_order_relaxed) - index;
+            occupancy_sum_ += in_flight;
+            occupancy_max_ = std::max(occupancy_max_, in_flight);
+
+            Slot& slot = lane.slots[index % capacity_];
+            if (slot.sequence != sequence) { // Would mean a broken ring protocol
+                std::cerr << "pipeline: expected line " << sequence << ", got " << slot.sequence << '\n';
+                std::abort();
+            }
+            bool exit = slot.command.type == CommandType::EXIT;
+            if (!exit) {
+                EngineStats::TimePoint execute_start = EngineStats::now();
+                game.execute(slot.command, out);
+                game.recordTiming(slot.command.type, slot.parse_start, slot.parse_end, execute_start, EngineStats::now());
+                ++applied_lines_;
+            }
+            lane.applied.store(index + 1, std::memory_order_release);
+            if (exit) {
+                stop_.store(true, std::memory_order_relaxed);
+                return;
+            }
+        }
+    }
+
+    static double perSecond(unsigned long long count, Clock::duration busy) {
+        double seconds = std::chrono::duration<double>(busy).count();
+        return seconds > 0 ? count / seconds : 0.0;
+    }
+
+public:
+    CommandPipeline(size_t lane_count, size_t capacity = GameConstants::PIPELINE_RING_CAPACITY)
+        : lane_count_(std::max<size_t>(1, lane_count)), capacity_(capacity), lanes_(new Lane[lane_count_]) {
+        for (size_t i = 0; i < lane_count_; ++i) {
+            lanes_[i].slots.reset(new Slot[capacity_]);
+        }
+    }
+
+    // Runs the whole input through `game`; returns once input ends or an EXIT is applied.
+    // After an EXIT the reader may still be waiting for input, so it is cancelled.
+    void run(InputSource& input, WitcherGame& game, OutputWriter& out) {
+        Clock::time_point start = Clock::now();
+        std::thread reader([this, &input] { readerLoop(input); });
+        std::vector<std::thread> parsers;
+        for (size_t i = 0; i < lane_count_; ++i) {
+            parsers.emplace_back([this, i] { parserLoop(lanes_[i]); });
+        }
+        applierLoop(game, out);
+        if (stop_.load(std::memory_order_relaxed)) {
+            input.cancel();
+        }
+        reader.join();
+        for (std::thread& parser : parsers) parser.join();
+        out.flush();
+        elapsed_ = Clock::now() - start;
+    }
+
+    // Per-stage throughput (lines per second of non-waiting time) and ring occupancy
+    void report(std::ostream& os) const {
+        auto ms = [](Clock::duration d) { return std::chrono::duration<double, std::milli>(d).count(); };
+        Clock::duration parser_wait{};
+        unsigned long long parsed_lines = 0;
+        for (size_t i = 0; i < lane_count_; ++i) {
+            parser_wait += lanes_[i].parser_wait;
+            parsed_lines += lanes_[i].parsed_lines;
+        }
+        Clock::duration parser_busy = elapsed_ * static_cast<long>(lane_count_) - parser_wait;
+        os << "pipeline: " << lane_count_ << " parser lanes x " << capacity_ << " slots, "
+           << line_count_ << " lines in " << ms(elapsed_) << " ms\n";
+        os << "  reader:  waited " << ms(reader_wait_) << " ms, "
+           << perSecond(line_count_, elapsed_ - reader_wait_) << " lines/s busy\n";
+        os << "  parsers: waited " << ms(parser_wait) << " ms in total, "
+           << perSecond(parsed_lines, parser_busy) << " lines/s per busy parser\n";
+        os << "  applier: waited " << ms(applier_wait_) << " ms, "
+           << perSecond(applied_lines_, elapsed_ - applier_wait_) << " lines/s busy\n";
+        os << "  lane occupancy: mean "
+           << (applied_lines_ ? static_cast<double>(occupancy_sum_) / applied_lines_ : 0.0)
+           << ", max " << occupancy_max_ << " of " << capacity_ << '\n';
+    }
+};
+
+// Fixed set of worker threads that run batches of independent tasks. Each worker has its
+// own deque: it pops from the back of its own and, once that is empty, steals from the
+// front of the others. The calling thread takes part as worker 0.
+class WorkStealingPool {
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<uint32_t> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues_; // One per worker, the caller's first
+    std::vector<std::thread> threads_;
+    const std::function<void(uint32_t)>* task_ = nullptr; // Body of the current batch
+
+    std::mutex state_mutex_;
+    std::condition_variable work_ready_;
+    std::condition_variable work_done_;
+    uint64_t batch_ = 0;        // Incremented to start a batch
+    bool shutdown_ = false;
+    std::atomic<size_t> remaining_{0};
+    size_t busy_workers_ = 0;   // Helper threads still inside the current batch
+
+    bool popOwn(size_t worker, uint32_t& task) {
+        Queue& queue = *queues_[worker];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) return false;
+        task = queue.tasks.back();
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(size_t thief, uint32_t& task) {
+        for (size_t offset = 1; offset < queues_.size(); ++offset) {
+            Queue& queue = *queues_[(thief + offset) % queues_.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.tasks.empty()) {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Runs tasks until every queue is empty
+    void drain(size_t worker) {
+        uint32_t task;
+        while (popOwn(worker, task) || steal(worker, task)) {
+            (*task_)(task);
+            remaining_.fetch_sub(1, std::memory_order_acq_rel);
+        }
+    }
+
+    void workerLoop(size_t worker) {
+        uint64_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(state_mutex_);
+                work_ready_.wait(lock, [&] { return shutdown_ || batch_ != seen; });
+                if (shutdown_) return;
+                seen = batch_;
+            }
+            drain(worker);
+            std::lock_guard<std::mutex> lock(state_mutex_);
+            if (--busy_workers_ == 0) work_done_.notify_one();
+        }
+    }
+
+public:
+    // `threads` helper threads in addition to the caller
+    explicit WorkStealingPool(size_t threads) {
+        for (size_t i = 0; i <= threads; ++i) queues_.push_back(std::make_unique<Queue>());
+        for (size_t i = 1; i <= threads; ++i) threads_.emplace_back([this, i] { workerLoop(i); });
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(state_mutex_);
+            shutdown_ = true;
+        }
+        work_ready_.notify_all();
+        for (std::thread& thread : threads_) thread.join();
+    }
+
+    size_t workerCount() const { return queues_.size(); }
+
+    // Calls task(i) for every i in `tasks`, in any order and on any worker; returns when all are done
+    void run(const std::vector<uint32_t>& tasks, const std::function<void(uint32_t)>& task) {
+        if (tasks.size() <= 1 || threads_.empty()) { // Not worth waking anyone
+            for (uint32_t t : tasks) task(t);
+            return;
+        }
+        task_ = &task;
+        remaining_.store(tasks.size(), std::memory_order_relaxed);
+        for (size_t i = 0; i < tasks.size(); ++i) { // Deal round-robin; stealing evens out the rest
+            Queue& queue = *queues_[i % queues_.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(tasks[i]);
+        }
+        {
+            std::lock_guard<std::mutex> lock(state_mutex_);
+            ++batch_;
+            busy_workers_ = threads_.size();
+        }
+        work_ready_.notify_all();
+        drain(0);
+        std::unique_lock<std::mutex> lock(state_mutex_);
+        work_done_.wait(lock, [&] { return busy_workers_ == 0; });
+        task_ = nullptr;
+    }
+};
+
+// Applies batch input in parallel where commands do not interfere (--parallel N).
+// Lines are read and parsed a window at a time. Each window is cut into segments at
+// barrier commands (see CommandFootprint). Within a segment every command gets a level:
+// one more than the highest level of any earlier command it conflicts with on a state
+// key. Levels run one after another, and the commands of a level run concurrently on the
+// pool. Every command writes into its own buffer, and the buffers are merged in input
+// order, so the output is identical to a serial run.
+class ParallelApplier {
+private:
+    // Levels of the latest writer and latest reader of one state key in the current segment
+    struct KeyLevels {
+        uint32_t write = 0;
+        uint32_t read = 0;
+    };
+
+    WorkStealingPool pool_;
+    size_t window_size_;
+    CommandParser parser_;
+    // When a command was parsed and executed; written by whichever thread does that, and
+    // handed to WitcherGame::recordTiming in input order by applyWindow()
+    struct Timing {
+        EngineStats::TimePoint parse_start{};
+        EngineStats::TimePoint parse_end{};
+        EngineStats::TimePoint execute_start{};
+        EngineStats::TimePoint execute_end{};
+    };
+
+    std::vector<Parsed::Command> commands_;
+    std::vector<Timing> timings_;       // One per window position
+    std::vector<OutputWriter> outputs_; // One per window position, reused across windows
+    std::vector<std::vector<uint32_t>> levels_;
+    std::unordered_map<uint64_t, KeyLevels> key_levels_;
+    CommandFootprint footprint_;
+
+    // Statistics
+    unsigned long long commands_applied_ = 0;
+    unsigned long long barriers_ = 0;
+    unsigned long long levels_run_ = 0;
+    unsigned long long parallel_commands_ = 0; // Commands that ran in a level of two or more
+
+    // Executes commands_[i] into outputs_[i] and notes when it ran
+    void execute(WitcherGame& game, size_t i) {
+        timings_[i].execute_start = EngineStats::now();
+        game.execute(commands_[i], outputs_[i]);
+        timings_[i].execute_end = EngineStats::now();
+    }
+
+    // Records the timings of commands_[from, to), which have all been executed
+    void recordTimings(WitcherGame& game, size_t from, size_t to) {
+        for (size_t i = from; i < to; ++i) {
+            const Timing& timing = timings_[i];
+            game.recordTiming(commands_[i].type, timing.parse_start, timing.parse_end, timing.execute_start, timing.execute_end);
+        }
+    }
+
+    // Runs levels 1..level_count of the current segment in order
+    void runLevels(WitcherGame& game, size_t level_count) {
+        std::function<void(uint32_t)> apply = [&](uint32_t i) { execute(game, i); };
+        for (size_t level = 1; level <= level_count; ++level) {
+            std::vector<uint32_t>& tasks = levels_[level];
+            if (tasks.empty()) continue;
+            pool_.run(tasks, apply);
+            ++levels_run_;
+            if (tasks.size() > 1) parallel_commands_ += tasks.size();
+            tasks.clear();
+        }
+    }
+
+    // Applies commands_[0, count), writing each response to the matching outputs_ entry
+    void applyWindow(WitcherGame& game, size_t count) {
+        size_t i = 0;
+        while (i < count) {
+            size_t segment_start = i;
+            // Analyse up to the next barrier. Barriers are the only commands that change the
+            // shape of the state, so footprints computed here stay accurate for the segment.
+            key_levels_.clear();
+            size_t level_count = 0;
+            for (; i < count; ++i) {
+                game.describe(commands_[i], footprint_);
+                if (footprint_.barrier) break;
+                uint32_t level = 1;
+                for (uint64_t key : footprint_.reads) {
+                    auto it = key_levels_.find(key);
+                    if (it != key_levels_.end()) level = std::max(level, it->second.write + 1);
+                }
+                for (uint64_t key : footprint_.writes) {
+                    auto it = key_levels_.find(key);
+                    if (it != key_levels_.end()) level = std::max({level, it->second.write + 1, it->second.read + 1});
+                }
+                for (uint64_t key : footprint_.reads) {
+                    KeyLevels& levels = key_levels_[key];
+                    levels.read = std::max(levels.read, level);
+                }
+                for (uint64_t key : footprint_.writes) {
+                    key_levels_[key].write = level;
+                }
+                if (level >= levels_.size()) levels_.resize(level + 1);
+                levels_[level].push_back(static_cast<uint32_t>(i));
+                level_count = std::max<size_t>(level_count, level);
+            }
+            runLevels(game, level_count);
+            recordTimings(game, segment_start, i); // Before the barrier, which may be Stats?
+            if (i < count) { // The barrier runs alone
+                execute(game, i);
+                recordTimings(game, i, i + 1);
+                ++barriers_;
+                ++i;
+            }
+        }
+        commands_applied_ += count;
+    }
+
+public:
+    ParallelApplier(size_t threads, size_t window_size = GameConstants::PARALLEL_WINDOW_SIZE)
+        : pool_(threads > 0 ? threads - 1 : 0), window_size_(window_size) {
+        commands_.resize(window_size_);
+        timings_.resize(window_size_);
+        outputs_.reserve(window_size_);
+        for (size_t i = 0; i < window_size_; ++i) outputs_.push_back(OutputWriter::toMemory());
+    }
+
+    // Runs the whole input through `game`; returns once input ends or an EXIT is reached
+    void run(InputSource& input, WitcherGame& game, OutputWriter& out) {
+        bool copy_lines = !input.linesOutliveSource();
+        bool exit = false;
+        while (!exit) {
+            size_t count = 0;
+            std::string_view line;
+            while (count < window_size_ && input.nextLine(line)) {
+                EngineStats::TimePoint parse_start = EngineStats::now();
+                Parsed::Command cmd = copy_lines ? parser_.parse(line) : parser_.parseInPlace(line);
+                if (cmd.type == CommandType::EXIT) {
+                    exit = true;
                     break;
+                }
+                timings_[count].parse_start = parse_start;
+                timings_[count].parse_end = EngineStats::now();
+                commands_[count++] = cmd;
+            }
+            applyWindow(game, count);
+            for (size_t i = 0; i < count; ++i) {
+                out << outputs_[i].contents();
+                outputs_[i].clear();
+            }
+            parser_.endBatch();
+            if (count < window_size_ && !exit) break; // Input ended inside this window
+        }
+        out.flush();
+    }
+
+    void report(std::ostream& os) const {
+        os << "parallel: " << pool_.workerCount() << " workers, window " << window_size_ << ", "
+           << commands_applied_ << " commands, " << barriers_ << " barriers, " << levels_run_ << " levels, "
+           << parallel_commands_ << " commands in levels of two or more";
+        if (levels_run_ > 0) {
+            os << ", mean level width " << static_cast<double>(commands_applied_ - barriers_) / levels_run_;
+        }
+        os << '\n';
+    }
+};
+
+// Reconstructs the state of a recorded session as of its command N (--replay LOG --seek N).
+// The log is a command file, mapped whole; its line N is command N and "Exit" ends it.
+// Replay parses every line but runs only the state-changing commands, with responses
+// suppressed. Every `interval` commands it takes a checkpoint: a snapshot of the state and
+// the log offset it stops at, kept in memory or, with a checkpoint directory, written there
+// for later runs. A seek restores the nearest checkpoint at or before N and replays fewer
+// than `interval` commands from it, so its cost does not grow with the log. The directory's
+// index records the checksum of all the log's bytes, plus cheap signals of the file: its
+// size, inode, modification time and the checksums of its first and last bytes. An open
+// compares only the signals; if any of them changed (or verification is requested), it
+// checksums the whole log and rebuilds the checkpoints when that no longer matches.
+class ReplayEngine {
+private:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr const char* INDEX_MAGIC = "witcher-replay 3";
+    static constexpr size_t SIGNAL_BYTES = 64 * 1024; // Checksummed at each end of the log
+
+    struct Checkpoint {
+        uint64_t command;     // Commands applied
+        uint64_t offset;      // Log bytes consumed
+        std::string snapshot; // Contents, when checkpoints stay in memory
+    };
+
+    uint64_t interval_;
+    std::unique_ptr<Snapshot::File> log_;
+    std::string directory_;               // Empty: checkpoints stay in memory
+    std::string log_path_;
+    bool verify_ = false;                 // Checksum the whole log even if its signals match
+    std::string signals_;                 // Cheap identity of the log, for the directory's index
+    std::optional<uint64_t> log_checksum_; // Of the whole log, computed on first use
+    std::vector<Checkpoint> checkpoints_; // Ascending by command; the first is the empty game
+    bool complete_ = false;               // Checkpoints were taken through the end of the log
+    uint64_t command_count_ = 0;          // Commands in the log, once complete
+
+    // Statistics
+    unsigned long long replayed_ = 0;
+    Clock::duration replay_time_{};
+    unsigned long long checkpoint_bytes_ = 0;
+    Clock::duration checkpoint_time_{};
+    unsigned long long seeks_ = 0;
+    Clock::duration seek_time_{};
+    Clock::duration checksum_time_{};
+
+    std::string checkpointPath(uint64_t command) const {
+        return (std::filesystem::path(directory_) / ("checkpoint-" + std::to_string(command) + ".snap")).string();
+    }
+
+    std::string indexPath() const {
+        return (std::filesystem::path(directory_) / "replay.index").string();
+    }
+
+    // "log <size> <inode> <mtime> <checksum of the first bytes> <checksum of the last bytes>",
+    // all available without reading the whole log
+    std::string computeSignals() const {
+        unsigned long long inode = 0;
+#if WITCHER_POSIX
+        struct stat info;
+        if (stat(log_path_.c_str(), &info) == 0) inode = static_cast<unsigned long long>(info.st_ino);
+#endif
+        std::error_code error;
+        long long mtime = static_cast<long long>(std::filesystem::last_write_time(log_path_, error).time_since_epoch().count());
+        size_t span = std::min(log_->size(), SIGNAL_BYTES);
+        return "log " + std::to_string(log_->size()) + " " + std::to_string(inode) + " " + std::to_string(mtime) + " " +
+               std::to_string(Snapshot::checksum(log_->data(), span)) + " " +
+               std::to_string(Snapshot::checksum(log_->data() + log_->size() - span, span));
+    }
+
+    // One pass over the mapped log, far cheaper than replaying it, and done at most once
+    uint64_t logChecksum() {
+        if (!log_checksum_) {
+            Clock::time_point start = Clock::now();
+            log_checksum_ = Snapshot::checksum(log_->data(), log_->size());
+            checksum_time_ = Clock::now() - start;
+        }
+        return *log_checksum_;
+    }
+
+    // Adopts the directory's checkpoints if its index was built from this log with this
+    // interval. The whole log is checksummed only when its signals changed or verify_ is set;
+    // an index whose log merely changed signals (e.g. was copied) is rewritten with the new ones.
+    bool loadIndex() {
+        std::ifstream index(indexPath());
+        std::string line;
+        if (!std::getline(index, line) || line != INDEX_MAGIC) return false;
+        std::string signals;
+        if (!std::getline(index, signals)) return false;
+        std::string word;
+        uint64_t checksum = 0;
+        if (!(index >> word >> checksum) || word != "checksum" || !std::getline(index, line) || !line.empty()) return false;
+        if (!std::getline(index, line) || line != "interval " + std::to_string(interval_)) return false;
+        bool signals_changed = signals != signals_;
+        if ((signals_changed || verify_) && checksum != logChecksum()) return false;
+        uint64_t command_count = 0;
+        if (!(index >> word >> command_count) || word != "commands") return false;
+        std::vector<Checkpoint> checkpoints(1, Checkpoint{0, 0, {}});
+        uint64_t command = 0;
+        uint64_t offset = 0;
+        while (index >> word >> command >> offset) {
+            if (word != "checkpoint" || command <= checkpoints.back().command || command > command_count ||
+                offset > log_->size() || !std::filesystem::exists(checkpointPath(command))) {
+                return false;
+            }
+            checkpoints.push_back(Checkpoint{command, offset, {}});
+        }
+        if (!index.eof()) return false;
+        checkpoints_ = std::move(checkpoints);
+        command_count_ = command_count;
+        complete_ = true;
+        if (signals_changed) writeIndex(); // Best effort; the checkpoints are valid either way
+        return true;
+    }
+
+    bool writeIndex() {
+        std::ostringstream index;
+        index << INDEX_MAGIC << '\n' << signals_ << '\n' << "checksum " << logChecksum() << '\n'
+              << "interval " << interval_ << '\n' << "commands " << command_count_ << '\n';
+        for (size_t i = 1; i < checkpoints_.size(); ++i) {
+            index << "checkpoint " << checkpoints_[i].command << ' ' << checkpoints_[i].offset << '\n';
+        }
+        if (!Snapshot::writeFile(indexPath(), index.str())) {
+            std::cerr << "replay: cannot write " << indexPath() << ": " << std::strerror(errno) << '\n';
+            return false;
+        }
+        return true;
+    }
+
+    // Removes the checkpoint files of an index that no longer matches
+    void removeCheckpointFiles() const {
+        std::error_code error;
+        for (const auto& file : std::filesystem::directory_iterator(directory_, error)) {
+            std::string name = file.path().filename().string();
+            if (name.rfind("checkpoint-", 0) == 0 && file.path().extension() == ".snap") {
+                std::filesystem::remove(file.path(), error);
+            }
+        }
+    }
+
+    bool takeCheckpoint(const WitcherGame& game, uint64_t command, uint64_t offset) {
+        Clock::time_point start = Clock::now();
+        std::string snapshot = game.snapshotBytes();
+        checkpoint_bytes_ += snapshot.size();
+        if (!directory_.empty()) {
+            if (!Snapshot::writeFile(checkpointPath(command), snapshot)) {
+                std::cerr << "replay: cannot write " << checkpointPath(command) << ": " << std::strerror(errno) << '\n';
+                return false;
+            }
+            snapshot.clear();
+        }
+        checkpoints_.push_back(Checkpoint{command, offset, std::move(snapshot)});
+        checkpoint_time_ += Clock::now() - start;
+        return true;
+    }
+
+    // A game in the state of `checkpoint`, or nullptr after saying why it could not be restored
+    std::unique_ptr<WitcherGame> restore(const Checkpoint& checkpoint) const {
+        auto game = std::make_unique<WitcherGame>();
+        if (checkpoint.command == 0) return game;
+        bool loaded = directory_.empty()
+            ? game->loadSnapshot(Snapshot::File::copyOf(checkpoint.snapshot),
+                                 "checkpoint at command " + std::to_string(checkpoint.command))
+            : game->loadSnapshot(checkpointPath(checkpoint.command));
+        return loaded ? std::move(game) : nullptr;
+    }
+
+    // Applies log lines from `offset` until `command` reaches `target`, advancing both.
+    // Returns false if the log ends first.
+    bool replayForward(WitcherGame& game, uint64_t& offset, uint64_t& command, uint64_t target) {
+        Clock::time_point start = Clock::now();
+        const char* cursor = log_->data() + offset;
+        const char* end = log_->data() + log_->size();
+        uint64_t first = command;
+        std::string_view line;
+        bool reached = true;
+        while (command < target) {
+            if (!split_line(cursor, end, line) || !game.replayLine(line)) {
+                reached = false;
+                break;
+            }
+            ++command;
+        }
+        offset = static_cast<uint64_t>(cursor - log_->data());
+        replayed_ += command - first;
+        replay_time_ += Clock::now() - start;
+        return reached;
+    }
+
+public:
+    static constexpr uint64_t END = UINT64_MAX; // seek() target for the end of the log
+
+    explicit ReplayEngine(uint64_t interval) : interval_(std::max<uint64_t>(interval, 1)) {}
+
+    ReplayEngine(const ReplayEngine&) = delete;
+    ReplayEngine& operator=(const ReplayEngine&) = delete;
+
+    // Maps the log at `path` and, if `directory` is not empty, keeps checkpoints there,
+    // adopting those already present when they belong to this log; `verify` checksums the
+    // whole log before adopting them even if it looks unchanged. Returns false, after
+    // saying why, if the log cannot be read.
+    bool open(const std::string& path, const std::string& directory, bool verify = false) {
+        std::error_code error;
+        if (std::filesystem::is_regular_file(path, error) && std::filesystem::file_size(path, error) == 0) {
+            log_ = Snapshot::File::copyOf({}); // Cannot be mapped, but is a valid recording of nothing
+        } else {
+            log_ = std::make_unique<Snapshot::File>(path);
+        }
+        if (!log_->ok()) {
+            std::cerr << "replay: cannot read " << path << '\n';
+            return false;
+        }
+        checkpoints_.assign(1, Checkpoint{0, 0, {}});
+        log_path_ = path;
+        verify_ = verify;
+        log_checksum_.reset();
+        directory_ = directory;
+        if (!directory_.empty()) {
+            std::filesystem::create_directories(directory_, error);
+            if (error) {
+                std::cerr << "replay: cannot create " << directory_ << ": " << error.message() << '\n';
+                return false;
+            }
+            signals_ = computeSignals();
+            loadIndex();
+        }
+        return true;
+    }
+
+    // Replays the whole log, taking a checkpoint every `interval` commands. Does nothing if
+    // the checkpoints are complete already, as after open() adopted a matching directory.
+    bool build() {
+        if (complete_) return true;
+        if (!directory_.empty()) removeCheckpointFiles();
+        checkpoints_.resize(1);
+        WitcherGame game;
+        uint64_t command = 0;
+        uint64_t offset = 0;
+        while (replayForward(game, offset, command, command + interval_)) {
+            if (!takeCheckpoint(game, command, offset)) return false;
+        }
+        command_count_ = command;
+        complete_ = true;
+        return directory_.empty() || writeIndex();
+    }
+
+    // A game in the state as of command `command` (END: the end of the log), or nullptr
+    // after saying why there is none
+    std::unique_ptr<WitcherGame> seek(uint64_t command) {
+        Clock::time_point start = Clock::now();
+        if (complete_ && command != END && command > command_count_) {
+            std::cerr << "replay: the log has only " << command_count_ << " commands" << '\n';
+            return nullptr;
+        }
+        auto nearest = std::upper_bound(checkpoints_.begin(), checkpoints_.end(), command,
+                                        [](uint64_t target, const Checkpoint& checkpoint) { return target < checkpoint.command; });
+        const Checkpoint& checkpoint = *(nearest - 1);
+        std::unique_ptr<WitcherGame> game = restore(checkpoint);
+        if (!game) return nullptr;
+        uint64_t applied = checkpoint.command;
+        uint64_t offset = checkpoint.offset;
+        if (!replayForward(*game, offset, applied, command) && command != END) {
+            std::cerr << "replay: the log has only " << applied << " commands" << '\n';
+            return nullptr;
+        }
+        ++seeks_;
+        seek_time_ += Clock::now() - start;
+        return game;
+    }
+
+    size_t checkpointCount() const { return checkpoints_.size() - 1; }
+    uint64_t commandCount() const { return command_count_; }
+
+    void report(std::ostream& os) const {
+        double replay_seconds = std::chrono::duration<double>(replay_time_).count();
+        os << "replay: " << replayed_ << " commands in " << replay_seconds << " s";
+        if (replayed_ > 0) os << " (" << static_cast<double>(replayed_) / replay_seconds << " commands/s)";
+        os << ", " << checkpointCount() << " checkpoints every " << interval_ << " commands";
+        if (checkpoint_bytes_ > 0) {
+            os << " (" << checkpoint_bytes_ << " bytes taken in "
+               << std::chrono::duration<double, std::milli>(checkpoint_time_).count() << " ms)";
+        }
+        if (seeks_ > 0) {
+            os << ", " << seeks_ << " seeks in " << std::chrono::duration<double, std::milli>(seek_time_).count() << " ms";
+        }
+        if (log_checksum_) {
+            os << ", whole log checksummed in " << std::chrono::duration<double, std::milli>(checksum_time_).count() << " ms";
+        }
+        os << '\n';
+    }
+};
+
+// Pins the calling thread to one CPU where the platform supports it; a hint only
+inline void pinCurrentThread(size_t cpu) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(static_cast<int>(cpu % CPU_SETSIZE), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)cpu;
+#endif
+}
+
+using SessionId = uint64_t;
+
+// Sessions owned by one shard, keyed by session ID. A session is an independent
+// WitcherGame, created by its first command and dropped after an "Exit" line.
+class SessionTable {
+private:
+    std::unordered_map<SessionId, std::unique_ptr<WitcherGame>> sessions_;
+
+public:
+    WitcherGame& open(SessionId id) {
+        std::unique_ptr<WitcherGame>& game = sessions_[id];
+        if (!game) game = std::make_unique<WitcherGame>();
+        return *game;
+    }
+
+    void close(SessionId id) { sessions_.erase(id); }
+
+    size_t size() const { return sessions_.size(); }
+};
+
+// Hosts many game sessions in one process. Sessions are spread over shards by ID, and each
+// shard is one thread (pinned to a core where possible) that owns its sessions outright:
+// only the shard's inbox is locked, never a session. Responses go to the handler on the
+// shard's thread; the text is only valid during the call.
+class SessionHost {
+public:
+    using Clock = std::chrono::steady_clock;
+    using ResponseHandler = std::function<void(SessionId, std::string_view)>;
+
+private:
+    struct Request {
+        SessionId session;
+        std::string line;
+        Clock::time_point submitted;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::condition_variable work_ready;
+        std::condition_variable idle;
+        std::vector<Request> inbox;      // Guarded by mutex
+        bool busy = false;               // Guarded by mutex: a batch is being applied
+        bool stopping = false;           // Guarded by mutex
+        std::thread thread;
+
+        // Touched only by the shard's thread, and by others once it is idle
+        SessionTable sessions;
+        CommandParser parser;
+        OutputWriter out = OutputWriter::toMemory();
+        LatencyHistogram latency;        // Submit to response, in nanoseconds
+        unsigned long long commands = 0;
+    };
+
+    std::vector<std::unique_ptr<Shard>> shards_;
+    ResponseHandler handler_;
+
+    Shard& shardFor(SessionId id) {
+        return *shards_[(id * 0x9E3779B97F4A7C15ULL >> 32) % shards_.size()];
+    }
+
+    void apply(Shard& shard, const Request& request) {
+        Parsed::Command cmd = shard.parser.parseInPlace(request.line); // The request outlives the command
+        if (cmd.type == CommandType::EXIT) {
+            shard.sessions.close(request.session);
+        } else {
+            shard.sessions.open(request.session).execute(cmd, shard.out);
+        }
+        shard.parser.endBatch();
+        handler_(request.session, shard.out.contents());
+        shard.out.clear();
+        shard.latency.record(static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - request.submitted).count()));
+        ++shard.commands;
+    }
+
+    void shardLoop(Shard& shard, size_t index) {
+        pinCurrentThread(index);
+        std::vector<Request> batch;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(shard.mutex);
+                shard.busy = false;
+                if (shard.inbox.empty()) shard.idle.notify_all();
+                shard.work_ready.wait(lock, [&] { return shard.stopping || !shard.inbox.empty(); });
+                if (shard.inbox.empty()) return; // Stopping with nothing left to do
+                batch.swap(shard.inbox);
+                shard.busy = true;
+            }
+            for (const Request& request : batch) apply(shard, request);
+            batch.clear();
+        }
+    }
+
+public:
+    SessionHost(size_t shard_count, ResponseHandler handler) : handler_(std::move(handler)) {
+        for (size_t i = 0; i < std::max<size_t>(shard_count, 1); ++i) shards_.push_back(std::make_unique<Shard>());
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            Shard& shard = *shards_[i];
+            shard.thread = std::thread([this, &shard, i] { shardLoop(shard, i); });
+        }
+    }
+
+    SessionHost(const SessionHost&) = delete;
+    SessionHost& operator=(const SessionHost&) = delete;
+
+    ~SessionHost() { stop(); }
+
+    // Stops and joins the shard threads; no response handler runs after it returns.
+    // Owners whose handler uses their own members call this before tearing them down.
+    void stop() {
+        for (auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            shard->stopping = true;
+            shard->work_ready.notify_one();
+        }
+        for (auto& shard : shards_) {
+            if (shard->thread.joinable()) shard->thread.join();
+        }
+    }
+
+    // Queues one command line for a session; callable from any thread
+    void submit(SessionId session, std::string_view line) {
+        Shard& shard = shardFor(session);
+        Request request{session, std::string(line), Clock::now()};
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.inbox.push_back(std::move(request));
+        if (shard.inbox.size() == 1) shard.work_ready.notify_one();
+    }
+
+    // Blocks until every command submitted so far has been answered
+    void waitIdle() {
+        for (auto& shard : shards_) {
+            std::unique_lock<std::mutex> lock(shard->mutex);
+            shard->idle.wait(lock, [&] { return !shard->busy && shard->inbox.empty(); });
+        }
+    }
+
+    size_t shardCount() const { return shards_.size(); }
+
+    // The statistics below must only be read after waitIdle()
+    size_t sessionCount() const {
+        size_t total = 0;
+        for (const auto& shard : shards_) total += shard->sessions.size();
+        return total;
+    }
+
+    unsigned long long commandCount() const {
+        unsigned long long total = 0;
+        for (const auto& shard : shards_) total += shard->commands;
+        return total;
+    }
+
+    LatencyHistogram latency() const {
+        LatencyHistogram merged;
+        for (const auto& shard : shards_) merged.merge(shard->latency);
+        return merged;
+    }
+};
+
+#if WITCHER_EPOLL
+// Serves game sessions over a Unix-domain socket (--serve PATH). One event-loop thread
+// accepts connections and moves bytes with non-blocking I/O through epoll; commands run
+// on a SessionHost. Every connection is one session, and the protocol is the command
+// grammar itself: lines in, responses out, in order. Clients may pipeline any number of
+// lines. A connection ends with an "Exit" line or when the client shuts down its side,
+// after every pending response has been written.
+class SocketServer {
+private:
+    struct Connection {
+        int fd = -1;
+        SessionId session = 0;
+        std::string in;              // Bytes received but not yet split into lines
+        std::string out;             // Responses not yet written
+        size_t out_offset = 0;       // Bytes of `out` already written
+        size_t pending = 0;          // Lines submitted and not yet answered
+        bool reading = true;         // EPOLLIN is registered
+        bool writing = false;        // EPOLLOUT is registered
+        bool finished = false;       // No more lines will be accepted
+    };
+
+    struct Response {
+        SessionId session;
+        std::string text;
+    };
+
+    int listen_fd_ = -1;
+    int epoll_fd_ = -1;
+    int wake_fd_ = -1;  // eventfd signalled by shard threads when responses are ready
+    std::string path_;
+    SessionHost host_;
+    std::unordered_map<int, std::unique_ptr<Connection>> connections_; // By file descriptor
+    std::unordered_map<SessionId, Connection*> by_session_;
+    SessionId next_session_ = 1;
+
+    std::mutex responses_mutex_;
+    std::vector<Response> responses_; // Guarded by responses_mutex_; filled on shard threads
+
+    // Statistics
+    unsigned long long accepted_ = 0;
+    unsigned long long lines_ = 0;
+    unsigned long long bytes_in_ = 0;
+    unsigned long long bytes_out_ = 0;
+
+    static inline volatile std::sig_atomic_t stop_requested_ = 0;
+    static void requestStop(int) { stop_requested_ = 1; }
+
+    void onResponse(SessionId session, std::string_view text) { // Runs on a shard thread
+        std::lock_guard<std::mutex> lock(responses_mutex_);
+        responses_.push_back(Response{session, std::string(text)});
+        if (responses_.size() == 1) {
+            uint64_t one = 1;
+            ssize_t written = write(wake_fd_, &one, sizeof(one));
+            (void)written; // The eventfd counter cannot overflow in practice
+        }
+    }
+
+    void updateEvents(Connection& conn, bool reading, bool writing) {
+        if (conn.reading == reading && conn.writing == writing) return;
+        conn.reading = reading;
+        conn.writing = writing;
+        epoll_event event{};
+        event.events = (reading ? EPOLLIN : 0u) | (writing ? EPOLLOUT : 0u);
+        event.data.fd = conn.fd;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, conn.fd, &event);
+    }
+
+    void closeConnection(Connection& conn) {
+        if (!conn.finished) host_.submit(conn.session, "Exit"); // Drops the session
+        by_session_.erase(conn.session);
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, conn.fd, nullptr);
+        close(conn.fd);
+        connections_.erase(conn.fd); // Destroys conn
+    }
+
+    void acceptConnections() {
+        while (true) {
+            int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return; // EAGAIN, or a connection that went away before we got to it
+            auto conn = std::make_unique<Connection>();
+            conn->fd = fd;
+            conn->session = next_session_++;
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.fd = fd;
+            epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event);
+            by_session_[conn->session] = conn.get();
+            connections_[fd] = std::move(conn);
+            ++accepted_;
+        }
+    }
+
+    // Submits one received line; returns false once the connection takes no more lines
+    bool submitLine(Connection& conn, std::string_view line) {
+        ++conn.pending;
+        ++lines_;
+        host_.submit(conn.session, line); // The session's shard answers lines in order
+        if (ParserUtils::trim_whitespace(line) == "Exit") {
+            conn.finished = true; // The host drops the session; its answer is the last
+        }
+        return !conn.finished;
+    }
+
+    // Reads what is available and submits every complete line. Returns false if the
+    // connection was closed, which includes clients that send a line longer than
+    // SERVER_MAX_LINE_LENGTH: no command is that long, and its bytes would pile up in `in`.
+    bool readFrom(Connection& conn) {
+        char buffer[64 * 1024];
+        while (!conn.finished) {
+            ssize_t got = read(conn.fd, buffer, sizeof(buffer));
+            if (got < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                closeConnection(conn);
+                return false;
+            }
+            if (got == 0) { // Client is done sending; a final unterminated line still counts
+                if (!conn.in.empty()) submitLine(conn, conn.in);
+                conn.in.clear();
+                if (!conn.finished) {
+                    conn.finished = true;
+                    ++conn.pending;
+                    host_.submit(conn.session, "Exit");
+                }
+                break;
+            }
+            bytes_in_ += static_cast<size_t>(got);
+            conn.in.append(buffer, static_cast<size_t>(got));
+            size_t start = 0;
+            size_t newline;
+            while ((newline = conn.in.find('\n', start)) != std::string::npos) {
+                bool more = submitLine(conn, std::string_view(conn.in).substr(start, newline - start));
+                start = newline + 1;
+                if (!more) break;
+            }
+            conn.in.erase(0, start);
+            if (!conn.finished && conn.in.size() > GameConstants::SERVER_MAX_LINE_LENGTH) {
+                closeConnection(conn);
+                return false;
+            }
+            if (conn.pending >= GameConstants::SERVER_MAX_PENDING_LINES) break; // Let answers catch up
+        }
+        return flushTo(conn);
+    }
+
+    // Writes as much buffered output as the socket takes, then re-arms events and closes
+    // finished connections. Returns false if the connection was closed.
+    bool flushTo(Connection& conn) {
+        while (conn.out_offset < conn.out.size()) {
+            ssize_t written = send(conn.fd, conn.out.data() + conn.out_offset, conn.out.size() - conn.out_offset, MSG_NOSIGNAL);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                closeConnection(conn);
+                return false;
+            }
+            conn.out_offset += static_cast<size_t>(written);
+            bytes_out_ += static_cast<size_t>(written);
+        }
+        if (conn.out_offset == conn.out.size()) {
+            conn.out.clear();
+            conn.out_offset = 0;
+        }
+        bool drained = conn.out.empty();
+        if (conn.finished && conn.pending == 0 && drained) {
+            closeConnection(conn);
+            return false;
+        }
+        // Stop reading while a slow client lets answers pile up; resume once they drain
+        bool backlog = conn.pending >= GameConstants::SERVER_MAX_PENDING_LINES ||
+                       conn.out.size() >= GameConstants::OUTPUT_BUFFER_SIZE;
+        updateEvents(conn, !conn.finished && !backlog, !drained);
+        return true;
+    }
+
+    void deliverResponses() {
+        uint64_t count;
+        ssize_t got = read(wake_fd_, &count, sizeof(count));
+        (void)got;
+        std::vector<Response> ready;
+        {
+            std::lock_guard<std::mutex> lock(responses_mutex_);
+            ready.swap(responses_);
+        }
+        std::vector<SessionId> touched; // Sessions that had nothing left to write
+        for (Response& response : ready) {
+            auto it = by_session_.find(response.session);
+            if (it == by_session_.end()) continue; // Connection already gone
+            Connection& conn = *it->second;
+            if (conn.out.size() == conn.out_offset) touched.push_back(conn.session);
+            conn.out += response.text;
+            --conn.pending;
+        }
+        for (SessionId session : touched) {
+            auto it = by_session_.find(session);
+            if (it != by_session_.end()) flushTo(*it->second); // May close it
+        }
+    }
+
+public:
+    SocketServer(size_t shard_count)
+        : host_(shard_count, [this](SessionId session, std::string_view text) { onResponse(session, text); }) {}
+
+    SocketServer(const SocketServer&) = delete;
+    SocketServer& operator=(const SocketServer&) = delete;
+
+    ~SocketServer() {
+        host_.stop(); // Shards call onResponse, which uses responses_ and wake_fd_
+        for (auto& entry : connections_) close(entry.first);
+        if (listen_fd_ >= 0) {
+            close(listen_fd_);
+            unlink(path_.c_str());
+        }
+        if (wake_fd_ >= 0) close(wake_fd_);
+        if (epoll_fd_ >= 0) close(epoll_fd_);
+    }
+
+    // Binds the socket; an existing file at `path` is replaced. Returns false on failure.
+    bool listenOn(const std::string& path) {
+        sockaddr_un address{};
+        if (path.size() >= sizeof(address.sun_path)) {
+            std::cerr << "socket path too long: " << path << '\n';
+            return false;
+        }
+        address.sun_family = AF_UNIX;
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        unlink(path.c_str());
+        if (listen_fd_ < 0 || bind(listen_fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+            listen(listen_fd_, SOMAXCONN) < 0) {
+            std::cerr << "cannot listen on " << path << ": " << std::strerror(errno) << '\n';
+            return false;
+        }
+        path_ = path;
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epoll_fd_ < 0 || wake_fd_ < 0) {
+            std::cerr << "cannot create event loop: " << std::strerror(errno) << '\n';
+            return false;
+        }
+        for (int fd : {listen_fd_, wake_fd_}) {
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.fd = fd;
+            epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event);
+        }
+        return true;
+    }
+
+    // Serves until SIGINT or SIGTERM
+    void run() {
+        struct sigaction action{};
+        action.sa_handler = requestStop; // No SA_RESTART, so epoll_wait returns on a signal
+        sigaction(SIGINT, &action, nullptr);
+        sigaction(SIGTERM, &action, nullptr);
+
+        epoll_event events[256];
+        while (!stop_requested_) {
+            int ready = epoll_wait(epoll_fd_, events, 256, -1);
+            for (int i = 0; i < ready; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == listen_fd_) {
+                    acceptConnections();
+                } else if (fd == wake_fd_) {
+                    deliverResponses();
+                } else {
+                    auto it = connections_.find(fd);
+                    if (it == connections_.end()) continue; // Closed earlier in this round
+                    Connection& conn = *it->second;
+                    if (events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN)) {
+                        closeConnection(conn);
+                    } else if (events[i].events & EPOLLIN) {
+                        readFrom(conn);
+                    } else {
+                        flushTo(conn);
+                    }
+                }
             }
         }
     }
+
+    void report(std::ostream& os) const {
+        os << "serve: " << accepted_ << " connections, " << lines_ << " lines, " << bytes_in_ << " bytes in, "
+           << bytes_out_ << " bytes out" << '\n';
+    }
 };
+#endif
+
+// Synthetic-workload microbenchmarks, selected with --bench <name>
+namespace Bench {
+    using Clock = std::chrono::steady_clock;
+
+    // Deterministic generator so that runs are comparable across builds
+    class Lcg {
+    private:
+        uint64_t state_;
+
+    public:
+        explicit Lcg(uint64_t seed) : state_(seed) {}
+
+        uint32_t next() {
+            state_ = state_ * 6364136223846793005ULL + 1442695040888963407ULL;
+            return static_cast<uint32_t>(state_ >> 33);
+        }
+
+        // Uniform value in [0, bound)
+        uint32_t below(uint32_t bound) { return next() % bound; }
+
+        template <typename T, size_t N>
+        const T& pick(const T (&values)[N]) { return values[below(static_cast<uint32_t>(N))]; }
+    };
+
+    const char* const INGREDIENTS[] = {"Rebis", "Vitriol", "Quebrith", "Aether", "Hydragenum", "Vermilion",
+                                       "Sol", "Caelum", "Fulgur", "Bloodmoss", "Celandine", "Wolfsbane"};
+    const char* const POTIONS[] = {"Swallow", "Black Blood", "Golden Oriole", "White Raffards Decoction",
+                                   "Tawny Owl", "Full Moon", "Killer Whale", "Thunderbolt"};
+    const char* const SIGNS[] = {"Igni", "Quen", "Aard", "Yrden", "Axii"};
+    const char* const MONSTERS[] = {"Griffin", "Wyvern", "Nekker", "Drowner", "Ghoul", "Leshen", "Fiend", "Katakan"};
+
+    template <size_t N>
+    std::string makeItemList(Lcg& rng, const char* const (&names)[N], uint32_t max_items) {
+        std::string list;
+        uint32_t item_count = 1 + rng.below(max_items);
+        for (uint32_t i = 0; i < item_count; ++i) {
+            if (i > 0) list += ", ";
+            list += std::to_string(1 + rng.below(20));
+            list += ' ';
+            list += rng.pick(names);
+        }
+        return list;
+    }
+
+    // Command log dominated by learns and loot lines, like our replayed production logs
+    std::vector<std::string> makeCommandLog(size_t line_count, uint64_t seed) {
+        Lcg rng(seed);
+        std::vector<std::string> lines;
+        lines.reserve(line_count);
+        for (size_t i = 0; i < line_count; ++i) {
+            uint32_t roll = rng.below(100);
+            if (roll < 35) {
+                lines.push_back("Geralt loots " + makeItemList(rng, INGREDIENTS, 4));
+            } else if (roll < 50) {
+                lines.push_back(std::string("Geralt learns ") + rng.pick(SIGNS) + " sign is effective against " + rng.pick(MONSTERS));
+            } else if (roll < 65) {
+                lines.push_back(std::string("Geralt learns ") + rng.pick(POTIONS) + " potion is effective against " + rng.pick(MONSTERS));
+            } else if (roll < 75) {
+                lines.push_back(std::string("Geralt learns ") + rng.pick(POTIONS) + " potion consists of " +
+                                makeItemList(rng, INGREDIENTS, 5));
+            } else if (roll < 82) {
+                lines.push_back(std::string("Geralt brews ") + rng.pick(POTIONS));
+            } else if (roll < 88) {
+                lines.push_back(std::string("Geralt encounters a ") + rng.pick(MONSTERS));
+            } else if (roll < 91) {
+                lines.push_back("Geralt trades " + makeItemList(rng, MONSTERS, 2) + " trophy for " +
+                                makeItemList(rng, INGREDIENTS, 2));
+            } else if (roll < 94) {
+                lines.push_back(std::string("Total ingredient ") + rng.pick(INGREDIENTS) + "?");
+            } else if (roll < 97) {
+                lines.push_back(std::string("What is effective against ") + rng.pick(MONSTERS) + "?");
+            } else {
+                lines.push_back(std::string("What is in ") + rng.pick(POTIONS) + "?");
+            }
+        }
+        return lines;
+    }
+
+    // The keyword-scanning parser that the Grammar keyword table replaced, kept as the
+    // --bench parse baseline. It knows the grammar of that time only: no "brews N",
+    // "What can Geralt brew?", "What is <item> effective against?" or "Stats?".
+    namespace KeywordScan {
+        using namespace ParserUtils;
+
+        // Matches a whole-word keyword at the start of `sv` and advances past it and its trailing whitespace
+        bool match_and_advance(std::string_view& sv, std::string_view keyword) {
+            advance_past_whitespace(sv);
+            if (sv.rfind(keyword, 0) == 0) {
+                if (sv.length() == keyword.length() || AsciiScan::is_space(sv[keyword.length()])) {
+                    sv.remove_prefix(keyword.length());
+                    advance_past_whitespace(sv);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Finds a sequence of standalone keywords in `text`.
+        // Returns the text before the first keyword and the text after the last one,
+        // or {std::nullopt, std::nullopt} if the sequence does not occur.
+        std::pair<std::optional<std::string_view>, std::optional<std::string_view>>
+        find_keyword_sequence(std::string_view text, std::initializer_list<std::string_view> keywords) {
+            std::string_view first_keyword = *keywords.begin();
+            std::string_view search_origin = text; // Where the first keyword is looked for next
+            size_t origin_offset = 0;              // Offset of search_origin within text
+
+            while (!search_origin.empty()) {
+                auto found = find_standalone_substring(search_origin, first_keyword);
+                if (!found) return {std::nullopt, std::nullopt};
+
+                size_t keyword_start = found.value().second;
+                std::string_view after = found.value().first;
+                advance_past_whitespace(after);
+
+                bool sequence_match = true;
+                for (auto it = keywords.begin() + 1; it != keywords.end(); ++it) {
+                    std::string_view keyword = *it;
+                    if (after.rfind(keyword, 0) == 0 &&
+                        (after.length() == keyword.length() || AsciiScan::is_space(after[keyword.length()]))) {
+                        after.remove_prefix(keyword.length());
+                        advance_past_whitespace(after);
+                    } else {
+                        sequence_match = false;
+                        break;
+                    }
+                }
+                if (sequence_match) {
+                    return {text.substr(0, origin_offset + keyword_start), after};
+                }
+
+                size_t advance = keyword_start + 1; // Look for the first keyword again after this one
+                if (advance >= search_origin.length()) break;
+                search_origin.remove_prefix(advance);
+                origin_offset += advance;
+            }
+            return {std::nullopt, std::nullopt};
+        }
+
+        // parse_command_internal as it was before the keyword table: every candidate
+        // keyword is tried in turn, and "learns" bodies are searched once per phrase
+        Parsed::Command parse(std::string_view original_line, LineArena& arena) {
+            Parsed::Command result;
+            std::string_view line_view = trim_whitespace(original_line);
+            if (line_view.empty()) {
+                result.type = CommandType::EMPTY;
+                return result;
+            }
+            if (line_view == "Exit") {
+                result.type = CommandType::EXIT;
+                return result;
+            }
+
+            std::string_view p = line_view;
+            if (match_and_advance(p, "Geralt")) {
+                std::string_view p_after_geralt = p;
+
+                if (match_and_advance(p, "loots")) {
+                    auto items_opt = parse_item_list(p, false, arena);
+                    if (items_opt && !items_opt.value().empty()) {
+                        result.type = CommandType::LOOT;
+                        result.data = Parsed::LootPayload{items_opt.value()};
+                    }
+                    return result;
+                }
+                p = p_after_geralt;
+
+                if (match_and_advance(p, "trades")) {
+                    auto trophy_found = find_standalone_substring(p, "trophy");
+                    if (trophy_found) {
+                        std::string_view trophies_sv = trim_whitespace(p.substr(0, trophy_found.value().second));
+                        std::string_view after_trophy = trophy_found.value().first;
+                        advance_past_whitespace(after_trophy);
+                        if (trophies_sv.empty()) return result;
+
+                        auto for_found = find_standalone_substring(after_trophy, "for");
+                        if (for_found) {
+                            std::string_view after_for = for_found.value().first;
+                            advance_past_whitespace(after_for);
+                            auto trophies_opt = parse_item_list(trophies_sv, false, arena);
+                            auto ingredients_opt = parse_item_list(after_for, false, arena);
+                            if (trophies_opt && !trophies_opt.value().empty() &&
+                                ingredients_opt && !ingredients_opt.value().empty()) {
+                                result.type = CommandType::TRADE;
+                                result.data = Parsed::TradePayload{trophies_opt.value(), ingredients_opt.value()};
+                            }
+                        }
+                    }
+                    return result;
+                }
+                p = p_after_geralt;
+
+                if (match_and_advance(p, "brews")) {
+                    auto potion_name_opt = parse_name(p, true);
+                    if (potion_name_opt && !potion_name_opt.value().empty()) {
+                        result.type = CommandType::BREW;
+                        result.data = Parsed::BrewPayload{potion_name_opt.value()};
+                    }
+                    return result;
+                }
+                p = p_after_geralt;
+
+                if (match_and_advance(p, "learns")) {
+                    auto sign = find_keyword_sequence(p, {"sign", "is", "effective", "against"});
+                    if (sign.first && sign.second) {
+                        auto item_name_opt = parse_name(sign.first.value(), false);
+                        auto monster_name_opt = parse_name(sign.second.value(), false);
+                        if (item_name_opt && monster_name_opt) {
+                            result.type = CommandType::LEARN_EFFECTIVENESS;
+                            result.data = Parsed::LearnEffectivenessPayload{item_name_opt.value(), EffectivenessType::SIGN, monster_name_opt.value()};
+                        }
+                        return result;
+                    }
+
+                    auto potion = find_keyword_sequence(p, {"potion", "is", "effective", "against"});
+                    if (potion.first && potion.second) {
+                        auto item_name_opt = parse_name(potion.first.value(), true);
+                        auto monster_name_opt = parse_name(potion.second.value(), false);
+                        if (item_name_opt && monster_name_opt) {
+                            result.type = CommandType::LEARN_EFFECTIVENESS;
+                            result.data = Parsed::LearnEffectivenessPayload{item_name_opt.value(), EffectivenessType::POTION, monster_name_opt.value()};
+                        }
+                        return result;
+                    }
+
+                    auto formula = find_keyword_sequence(p, {"potion", "consists", "of"});
+                    if (formula.first && formula.second) {
+                        auto potion_name_opt = parse_name(formula.first.value(), true);
+                        auto ingredients_opt = parse_item_list(formula.second.value(), false, arena);
+                        if (potion_name_opt && ingredients_opt && !ingredients_opt.value().empty()) {
+                            result.type = CommandType::LEARN_FORMULA;
+                            result.data = Parsed::LearnFormulaPayload{potion_name_opt.value(), ingredients_opt.value()};
+                        }
+                    }
+                    return result;
+                }
+                p = p_after_geralt;
+
+                if (match_and_advance(p, "encounters")) {
+                    if (match_and_advance(p, "a")) {
+                        auto monster_name_opt = parse_name(p, false);
+                        if (monster_name_opt) {
+                            result.type = CommandType::ENCOUNTER;
+                            result.data = Parsed::EncounterPayload{monster_name_opt.value()};
+                        }
+                    }
+                    return result;
+                }
+                return result;
+            }
+            p = line_view;
+
+            if (match_and_advance(p, "Total")) {
+                if (!p.empty() && p.back() == '?') {
+                    p.remove_suffix(1);
+                    std::string_view query_content = trim_whitespace(p);
+                    if (query_content.empty()) return result;
+
+                    size_t first_space = query_content.find(' ');
+                    std::string_view category_sv = query_content.substr(0, first_space);
+                    std::string_view item_name_query;
+                    if (first_space != std::string_view::npos) {
+                        item_name_query = trim_whitespace(query_content.substr(first_space + 1));
+                    }
+                    if (category_sv != "ingredient" && category_sv != "potion" && category_sv != "trophy") {
+                        return result;
+                    }
+
+                    if (!item_name_query.empty()) {
+                        auto item_name_opt = parse_name(item_name_query, category_sv == "potion");
+                        if (item_name_opt) {
+                            result.type = CommandType::QUERY_TOTAL_SPECIFIC;
+                            result.data = Parsed::QueryTotalSpecificPayload{category_sv, item_name_opt.value()};
+                        }
+                    } else {
+                        result.type = CommandType::QUERY_TOTAL_ALL;
+                        result.data = Parsed::QueryTotalAllPayload{category_sv};
+                    }
+                }
+                return result;
+            }
+            p = line_view;
+
+            if (match_and_advance(p, "What") && match_and_advance(p, "is")) {
+                std::string_view p_after_what_is = p;
+                if (match_and_advance(p, "effective") && match_and_advance(p, "against")) {
+                    if (!p.empty() && p.back() == '?') {
+                        p.remove_suffix(1);
+                        auto monster_name_opt = parse_name(p, false);
+                        if (monster_name_opt) {
+                            result.type = CommandType::QUERY_EFFECTIVE_AGAINST;
+                            result.data = Parsed::QueryEffectiveAgainstPayload{monster_name_opt.value()};
+                        }
+                    }
+                    return result;
+                }
+                p = p_after_what_is;
+
+                if (match_and_advance(p, "in")) {
+                    if (!p.empty() && p.back() == '?') {
+                        p.remove_suffix(1);
+                        auto potion_name_opt = parse_name(p, true);
+                        if (potion_name_opt) {
+                            result.type = CommandType::QUERY_WHAT_IS_IN;
+                            result.data = Parsed::QueryWhatIsInPayload{potion_name_opt.value()};
+                        }
+                    }
+                }
+            }
+            return result;
+        }
+
+        // Same interface as CommandParser, so timeParse can drive either
+        class Parser {
+        private:
+            LineArena arena_;
+
+        public:
+            Parsed::Command parse(std::string_view line_str) { return KeywordScan::parse(arena_.copy(line_str), arena_); }
+            void endBatch() { arena_.reset(); }
+        };
+    } // namespace KeywordScan
+
+    // Renders a parsed command with its payload, so results of two parsers can be compared
+    std::string describeCommand(const Parsed::Command& cmd) {
+        std::string text = commandTypeName(cmd.type);
+        auto add = [&text](std::string_view field) { text += '|'; text += field; };
+        auto addItems = [&](const Parsed::ItemSpan& items) {
+            for (const Parsed::ItemInfo& item : items) {
+                add(std::to_string(item.quantity));
+                add(item.name);
+            }
+            add(";");
+        };
+        std::visit([&](const auto& payload) {
+            using Payload = std::decay_t<decltype(payload)>;
+            if constexpr (std::is_same_v<Payload, Parsed::LootPayload>) {
+                addItems(payload.items);
+            } else if constexpr (std::is_same_v<Payload, Parsed::TradePayload>) {
+                addItems(payload.trophies_to_give);
+                addItems(payload.ingredients_to_receive);
+            } else if constexpr (std::is_same_v<Payload, Parsed::BrewPayload>) {
+                add(payload.potion_name);
+                add(std::to_string(payload.count));
+                add(payload.batch ? "batch" : "single");
+            } else if constexpr (std::is_same_v<Payload, Parsed::LearnEffectivenessPayload>) {
+                add(payload.item_name);
+                add(payload.item_type == EffectivenessType::SIGN ? "sign" : "potion");
+                add(payload.monster_name);
+            } else if constexpr (std::is_same_v<Payload, Parsed::LearnFormulaPayload>) {
+                add(payload.potion_name);
+                addItems(payload.requirements);
+            } else if constexpr (std::is_same_v<Payload, Parsed::EncounterPayload>) {
+                add(payload.monster_name);
+            } else if constexpr (std::is_same_v<Payload, Parsed::QueryTotalSpecificPayload>) {
+                add(payload.category);
+                add(payload.item_name);
+            } else if constexpr (std::is_same_v<Payload, Parsed::QueryTotalAllPayload>) {
+                add(payload.category);
+            } else if constexpr (std::is_same_v<Payload, Parsed::QueryEffectiveAgainstPayload>) {
+                add(payload.monster_name);
+            } else if constexpr (std::is_same_v<Payload, Parsed::QueryItemEffectiveAgainstPayload>) {
+                add(payload.item_name);
+            } else if constexpr (std::is_same_v<Payload, Parsed::QueryWhatIsInPayload>) {
+                add(payload.potion_name);
+            }
+        }, cmd.data);
+        return text;
+    }
+
+    double nanosecondsPer(Clock::duration elapsed, size_t count) {
+        return count == 0 ? 0.0 : std::chrono::duration<double, std::nano>(elapsed).count() / static_cast<double>(count);
+    }
+
+    // Parses all lines `rounds` times and returns the elapsed time
+    template <typename Parser>
+    Clock::duration timeParse(Parser& parser, const std::vector<std::string>& lines, int rounds) {
+        const size_t batch_size = 1024;
+        size_t checksum = 0; // Keeps the optimizer from dropping the parse calls
+        Clock::time_point start = Clock::now();
+        for (int round = 0; round < rounds; ++round) {
+            for (size_t i = 0; i < lines.size(); ++i) {
+                checksum += static_cast<size_t>(parser.parse(lines[i]).type);
+                if ((i + 1) % batch_size == 0) parser.endBatch();
+            }
+            parser.endBatch();
+        }
+        Clock::duration elapsed = Clock::now() - start;
+        if (checksum == static_cast<size_t>(-1)) std::cerr << checksum;
+        return elapsed;
+    }
+
+    // --bench parse: CommandParser::parse against the KeywordScan baseline, per line,
+    // overall and per command type, after checking that both parse every line alike
+    void runParseBenchmark(std::ostream& os) {
+        const size_t line_count = 1000000;
+        const int rounds = 3;
+        std::vector<std::string> lines = makeCommandLog(line_count, 42);
+
+        CommandParser parser;
+        KeywordScan::Parser baseline;
+        std::array<std::vector<std::string>, COMMAND_TYPE_COUNT> by_type;
+        size_t mismatches = 0;
+        for (const std::string& line : lines) {
+            Parsed::Command cmd = parser.parse(line);
+            if (describeCommand(cmd) != describeCommand(baseline.parse(line))) ++mismatches;
+            by_type[static_cast<size_t>(cmd.type)].push_back(line);
+            parser.endBatch();
+            baseline.endBatch();
+        }
+
+        auto report = [&](const char* label, const std::vector<std::string>& subset) {
+            Clock::duration scan = timeParse(baseline, subset, rounds);
+            Clock::duration table = timeParse(parser, subset, rounds);
+            size_t count = subset.size() * rounds;
+            os << label << ": " << subset.size() << " lines, keyword scan " << nanosecondsPer(scan, count)
+               << " ns/line, keyword table " << nanosecondsPer(table, count) << " ns/line" << std::endl;
+        };
+        os << "parse: " << line_count << " lines x " << rounds << " rounds, "
+           << mismatches << " result mismatches vs keyword scan" << std::endl;
+        report("  all", lines);
+        for (size_t type = 0; type < COMMAND_TYPE_COUNT; ++type) {
+            if (by_type[type].empty()) continue;
+            std::string label = std::string("  ") + commandTypeName(static_cast<CommandType>(type));
+            report(label.c_str(), by_type[type]);
+        }
+    }
+
+    // The std::stol-based quantity parser that parse_quantity replaced, kept as the baseline
+    std::optional<int> parseQuantityWithStol(std::string_view token) {
+        if (token.empty()) return std::nullopt;
+        std::string token_str(token);
+        try {
+            size_t pos;
+            long val = std::stol(token_str, &pos);
+            if (pos != token_str.length() || val <= 0 || val > INT_MAX) {
+                return std::nullopt;
+            }
+            return static_cast<int>(val);
+        } catch (const std::invalid_argument&) {
+            return std::nullopt;
+        } catch (const std::out_of_range&) {
+            return std::nullopt;
+        }
+    }
+
+    // Quantity tokens as seen in adversarial feeds: 70% valid, 30% malformed
+    std::vector<std::string> makeQuantityCorpus(size_t count, uint64_t seed) {
+        const char* const MALFORMED[] = {"abc", "12a", "-7", "0", "99999999999", "2147483648", "+", "1.5",
+                                         "0x1F", "--3", "x", "999999999999999999999999"};
+        Lcg rng(seed);
+        std::vector<std::string> tokens;
+        tokens.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            if (rng.below(100) < 30) {
+                tokens.push_back(rng.pick(MALFORMED));
+            } else {
+                tokens.push_back(std::to_string(1 + rng.below(100000)));
+            }
+        }
+        return tokens;
+    }
+
+    // Times every call individually and prints mean and tail latencies
+    template <typename ParseFn>
+    void reportQuantityLatency(std::ostream& os, const char* label, const std::vector<std::string>& tokens, ParseFn parse) {
+        std::vector<double> latencies;
+        latencies.reserve(tokens.size());
+        long long checksum = 0;
+        for (const std::string& token : tokens) {
+            Clock::time_point start = Clock::now();
+            std::optional<int> value = parse(token);
+            Clock::time_point stop = Clock::now();
+            checksum += value.value_or(-1);
+            latencies.push_back(std::chrono::duration<double, std::nano>(stop - start).count());
+        }
+        double total = 0;
+        for (double latency : latencies) total += latency;
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&](double fraction) {
+            return latencies[std::min(latencies.size() - 1, static_cast<size_t>(fraction * static_cast<double>(latencies.size())))];
+        };
+        os << "  " << label << ": mean " << total / static_cast<double>(latencies.size()) << " ns, p50 " << percentile(0.50)
+           << " ns, p99 " << percentile(0.99) << " ns, p99.9 " << percentile(0.999) << " ns, max " << latencies.back()
+           << " ns (checksum " << checksum << ")" << std::endl;
+    }
+
+    // --bench quantity: ParserUtils::parse_quantity against the std::stol baseline, 30% invalid tokens
+    void runQuantityBenchmark(std::ostream& os) {
+        const size_t token_count = 1000000;
+        std::vector<std::string> tokens = makeQuantityCorpus(token_count, 7);
+
+        size_t mismatches = 0;
+        for (const std::string& token : tokens) {
+            if (ParserUtils::parse_quantity(token) != parseQuantityWithStol(token)) ++mismatches;
+        }
+        os << "quantity: " << token_count << " tokens, 30% malformed, " << mismatches << " result mismatches" << std::endl;
+        reportQuantityLatency(os, "std::stol + exceptions", tokens, parseQuantityWithStol);
+        reportQuantityLatency(os, "parse_quantity", tokens, ParserUtils::parse_quantity);
+    }
+
+    // Names for the classifier checks: mostly valid potion names, with random bytes mixed in
+    std::vector<std::string> makeNameCorpus(size_t count, uint64_t seed) {
+        const char ALPHABET[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+        Lcg rng(seed);
+        std::vector<std::string> names;
+        names.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            std::string name;
+            size_t length = 1 + rng.below(127);
+            for (size_t j = 0; j < length; ++j) {
+                uint32_t roll = rng.below(100);
+                if (roll < 85 || j == 0) name += ALPHABET[rng.below(sizeof(ALPHABET) - 1)];
+                else if (roll < 97) name += ' ';
+                else name += static_cast<char>(rng.below(256)); // Any byte, including other whitespace
+            }
+            names.push_back(name);
+        }
+        return names;
+    }
+
+    // --bench names: AsciiScan kernels checked against the scalar reference, then timed
+    void runNameBenchmark(std::ostream& os) {
+        std::vector<const AsciiScan::Kernels*> kernels = {&AsciiScan::SCALAR_KERNELS};
+#if WITCHER_X86_SIMD
+        kernels.push_back(&AsciiScan::SSE2_KERNELS);
+        if (__builtin_cpu_supports("avx2")) kernels.push_back(&AsciiScan::AVX2_KERNELS);
+#endif
+        const size_t name_count = 200000;
+        const int rounds = 20;
+        std::vector<std::string> names = makeNameCorpus(name_count, 11);
+        os << "names: " << name_count << " names of 1-127 bytes, active kernel " << AsciiScan::ACTIVE.name << std::endl;
+
+        for (const AsciiScan::Kernels* kernel : kernels) {
+            size_t mismatches = 0;
+            size_t accepted = 0;
+            for (const std::string& name : names) {
+                for (bool allow_spaces : {false, true}) {
+                    bool valid = kernel->is_valid_name(name.data(), name.size(), allow_spaces);
+                    accepted += valid;
+                    if (valid != AsciiScan::is_valid_name_scalar(name.data(), name.size(), allow_spaces)) ++mismatches;
+                }
+                std::string padded = "  \t" + name + " \n ";
+                if (kernel->first_non_space(padded.data(), padded.size()) != AsciiScan::first_non_space_scalar(padded.data(), padded.size()) ||
+                    kernel->end_of_non_space(padded.data(), padded.size()) != AsciiScan::end_of_non_space_scalar(padded.data(), padded.size())) {
+                    ++mismatches;
+                }
+            }
+
+            size_t checksum = 0;
+            Clock::time_point start = Clock::now();
+            for (int round = 0; round < rounds; ++round) {
+                for (const std::string& name : names) {
+                    checksum += kernel->is_valid_name(name.data(), name.size(), true);
+                    checksum += kernel->first_non_space(name.data(), name.size());
+                }
+            }
+            Clock::duration elapsed = Clock::now() - start;
+            os << "  " << kernel->name << ": " << nanosecondsPer(elapsed, name_count * rounds) << " ns/name, "
+               << accepted << " accepted, " << mismatches << " mismatches vs scalar (checksum " << checksum << ")" << std::endl;
+        }
+    }
+
+    // --bench sessions: idle memory of a session, then a closed-loop load generator
+    // driving many sessions through a SessionHost with one shard per core
+    void runSessionBenchmark(std::ostream& os) {
+        const size_t session_count = 10000;
+        const size_t commands_per_session = 100;
+        const size_t max_in_flight = 256;  // Load generator backs off beyond this
+        size_t shard_count = std::max<unsigned>(std::thread::hardware_concurrency(), 1u);
+
+        // Idle cost, measured on this thread alone so other threads' allocations don't count
+        if (!AllocationCounter::enabled) {
+            os << "sessions: idle memory is not measured in this build (define WITCHER_COUNT_ALLOCATIONS)" << std::endl;
+        } else {
+            SessionTable table;
+            unsigned long long bytes_before = AllocationCounter::bytes.load(std::memory_order_relaxed);
+            for (SessionId id = 0; id < session_count; ++id) table.open(id);
+            unsigned long long bytes = AllocationCounter::bytes.load(std::memory_order_relaxed) - bytes_before;
+            os << "sessions: " << static_cast<double>(bytes) / session_count << " bytes per idle session ("
+               << sizeof(WitcherGame) << " of them the WitcherGame object)" << std::endl;
+        }
+
+        // One script per session, drawn from the same command mix as --bench parse
+        std::vector<std::string> script = makeCommandLog(session_count * commands_per_session, 5);
+        std::atomic<unsigned long long> answered{0};
+        std::atomic<size_t> response_bytes{0};
+        SessionHost host(shard_count, [&](SessionId, std::string_view response) {
+            response_bytes.fetch_add(response.size(), std::memory_order_relaxed);
+            answered.fetch_add(1, std::memory_order_release);
+        });
+
+        Clock::time_point start = Clock::now();
+        unsigned long long submitted = 0;
+        for (size_t step = 0; step < commands_per_session; ++step) {
+            for (SessionId id = 0; id < session_count; ++id) { // Sessions take turns, like players
+                while (submitted - answered.load(std::memory_order_acquire) >= max_in_flight) std::this_thread::yield();
+                host.submit(id, script[id * commands_per_session + step]);
+                ++submitted;
+            }
+        }
+        host.waitIdle();
+        Clock::duration elapsed = Clock::now() - start;
+
+        LatencyHistogram latency = host.latency();
+        double seconds = std::chrono::duration<double>(elapsed).count();
+        os << "  " << host.sessionCount() << " sessions on " << host.shardCount() << " shards ("
+           << host.sessionCount() / host.shardCount() << " per core), " << host.commandCount() << " commands in "
+           << seconds * 1000.0 << " ms, " << static_cast<double>(host.commandCount()) / seconds / host.shardCount()
+           << " commands/s per core" << std::endl;
+        os << "  latency: p50 " << latency.percentile(0.50) / 1000.0 << " us, p99 " << latency.percentile(0.99) / 1000.0
+           << " us, max " << latency.max() / 1000.0 << " us (" << max_in_flight << " commands in flight at most, "
+           << response_bytes.load() << " response bytes)" << std::endl;
+    }
+
+    // --bench wal: commands/s of the serial loop without a command log, then with one at
+    // several group-commit sizes. The log lives in the temporary directory.
+    void runWalBenchmark(std::ostream& os) {
+        const size_t line_count = 50000;
+        std::vector<std::string> lines = makeCommandLog(line_count, 13);
+        std::string script;
+        for (const std::string& line : lines) {
+            script += line;
+            script += '\n';
+        }
+        std::string path = (std::filesystem::temp_directory_path() / "witcher-bench.wal").string();
+        os << "wal: " << line_count << " lines, log at " << path << std::endl;
+
+        double baseline = 0.0;
+        for (size_t group : {size_t{0}, size_t{1}, size_t{8}, size_t{64}, size_t{512}, size_t{4096}}) {
+            std::remove(path.c_str());
+            WitcherGame game;
+            std::unique_ptr<CommandLog> log;
+            if (group > 0) {
+                log = std::make_unique<CommandLog>(group);
+                if (!log->open(path, 0, [](uint64_t, std::string_view) {})) return;
+            }
+            std::istringstream stream(script);
+            StreamInput input(stream);
+            OutputWriter out = OutputWriter::discard();
+            Clock::time_point start = Clock::now();
+            game.run(input, out, false, log.get());
+            double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            double rate = static_cast<double>(line_count) / seconds;
+            if (group == 0) {
+                baseline = rate;
+                os << "  no log: " << rate << " commands/s" << std::endl;
+            } else {
+                os << "  group commit " << group << ": " << rate << " commands/s, " << baseline / rate
+                   << "x the time without a log" << std::endl;
+            }
+        }
+        std::remove(path.c_str());
+    }
+
+    // --bench replay: replay throughput and the cost of taking checkpoints, then the time
+    // of seeks at random offsets, restoring the nearest in-memory checkpoint versus replaying
+    // from the start. Both must reach the same state. The log lives in the temporary directory.
+    void runReplayBenchmark(std::ostream& os) {
+        const size_t line_count = 2000000;
+        const uint64_t interval = 100000;
+        std::vector<std::string> lines = makeCommandLog(line_count, 17);
+        std::string script;
+        for (const std::string& line : lines) {
+            script += line;
+            script += '\n';
+        }
+        lines.clear();
+        std::string path = (std::filesystem::temp_directory_path() / "witcher-bench.log").string();
+        if (!Snapshot::writeFile(path, script)) {
+            os << "replay: cannot write " << path << std::endl;
+            return;
+        }
+        os << "replay: " << line_count << " lines, log at " << path << std::endl;
+
+        ReplayEngine checkpointed(interval);
+        ReplayEngine from_start(line_count + 1); // Never reaches a checkpoint
+        if (!checkpointed.open(path, "") || !from_start.open(path, "") || !checkpointed.build()) return;
+        checkpointed.report(os);
+
+        Lcg rng(3);
+        LatencyHistogram with_checkpoints;
+        LatencyHistogram without_checkpoints;
+        size_t mismatches = 0;
+        for (int i = 0; i < 200; ++i) {
+            uint64_t command = 1 + rng.below(static_cast<uint32_t>(line_count));
+            Clock::time_point start = Clock::now();
+            std::unique_ptr<WitcherGame> game = checkpointed.seek(command);
+            with_checkpoints.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count()));
+            if (i % 20 != 0) continue; // Replaying from the start is too slow to do every time
+            start = Clock::now();
+            std::unique_ptr<WitcherGame> reference = from_start.seek(command);
+            without_checkpoints.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count()));
+            if (!game || !reference || game->snapshotBytes() != reference->snapshotBytes()) ++mismatches;
+        }
+        auto milliseconds = [](uint64_t nanoseconds) { return static_cast<double>(nanoseconds) / 1e6; };
+        os << "  seek with a checkpoint every " << interval << " commands: p50 " << milliseconds(with_checkpoints.percentile(0.5))
+           << " ms, max " << milliseconds(with_checkpoints.max()) << " ms" << std::endl;
+        os << "  seek from the start: p50 " << milliseconds(without_checkpoints.percentile(0.5))
+           << " ms, max " << milliseconds(without_checkpoints.max()) << " ms" << std::endl;
+        os << "  " << mismatches << " states differ from a replay from the start" << std::endl;
+        std::remove(path.c_str());
+    }
+
+    // Runs the named benchmark; returns false if no benchmark has that name
+    bool run(std::string_view name, std::ostream& os) {
+        if (name == "parse") {
+            runParseBenchmark(os);
+            return true;
+        }
+        if (name == "quantity") {
+            runQuantityBenchmark(os);
+            return true;
+        }
+        if (name == "names") {
+            runNameBenchmark(os);
+            return true;
+        }
+        if (name == "sessions") {
+            runSessionBenchmark(os);
+            return true;
+        }
+        if (name == "wal") {
+            runWalBenchmark(os);
+            return true;
+        }
+        if (name == "replay") {
+            runReplayBenchmark(os);
+            return true;
+        }
+        return false;
+    }
+} // namespace Bench
+
+#if WITCHER_EPOLL
+// Clients for --serve: a pass-through client for scripts, and a load generator
+namespace SocketClient {
+    using Clock = std::chrono::steady_clock;
+
+    // Returns a connected socket, or -1 after printing why not
+    int connectTo(const std::string& path) {
+        sockaddr_un address{};
+        if (path.size() >= sizeof(address.sun_path)) {
+            std::cerr << "socket path too long: " << path << '\n';
+            return -1;
+        }
+        address.sun_family = AF_UNIX;
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+            std::cerr << "cannot connect to " << path << ": " << std::strerror(errno) << '\n';
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // Copies `from` to `to` until end of input or an error; returns false on error
+    bool relay(int from, int to, bool to_socket) {
+        char buffer[64 * 1024];
+        while (true) {
+            ssize_t got = read(from, buffer, sizeof(buffer));
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) return got == 0;
+            for (ssize_t done = 0; done < got;) {
+                ssize_t written = to_socket ? send(to, buffer + done, static_cast<size_t>(got - done), MSG_NOSIGNAL)
+                                            : write(to, buffer + done, static_cast<size_t>(got - done));
+                if (written < 0 && errno == EINTR) continue;
+                if (written < 0) return false;
+                done += written;
+            }
+        }
+    }
+
+    // --connect PATH: sends stdin to the server and copies its answers to stdout.
+    // Sending runs on its own thread so that a long script cannot deadlock on full buffers.
+    int runPassThrough(const std::string& path) {
+        int fd = connectTo(path);
+        if (fd < 0) return 1;
+        std::thread sender([fd] {
+            relay(STDIN_FILENO, fd, true);
+            shutdown(fd, SHUT_WR); // The server answers what it has, then closes
+        });
+        bool ok = relay(fd, STDOUT_FILENO, false);
+        sender.join();
+        close(fd);
+        return ok ? 0 : 1;
+    }
+
+    // One load-generator connection: a script, what the server should answer, and the
+    // send times of lines whose answers are still outstanding
+    struct LoadConnection {
+        int fd = -1;
+        std::vector<std::string> script;
+        std::vector<uint32_t> answer_lines; // Lines of output each script line produces
+        std::string expected;               // The whole conversation's expected output
+        size_t received = 0;                // Bytes of it received so far
+        bool mismatch = false;
+        size_t next_line = 0;
+        std::string out;
+        size_t out_offset = 0;
+        std::deque<std::pair<Clock::time_point, uint32_t>> in_flight; // Send time, answer lines left
+    };
+
+    // Runs `conn.script` on a local game to learn the expected answers. Most commands
+    // answer with one line, but some (e.g. a brew whose formula lists an ingredient twice)
+    // answer with none, so answers cannot be matched to requests by counting alone.
+    void prepare(LoadConnection& conn) {
+        WitcherGame game;
+        CommandParser parser;
+        OutputWriter out = OutputWriter::toMemory();
+        for (const std::string& line : conn.script) {
+            size_t before = out.contents().size();
+            game.execute(parser.parse(line), out);
+            parser.endBatch();
+            std::string_view answer = out.contents().substr(before);
+            conn.answer_lines.push_back(static_cast<uint32_t>(std::count(answer.begin(), answer.end(), '\n')));
+        }
+        conn.expected = std::string(out.contents());
+    }
+
+    // --load PATH: `connection_count` connections, each pipelining up to `depth` lines of a
+    // generated script. Answers are checked against a local replay of the same script.
+    // Prints throughput and latency percentiles; latency covers lines that get an answer.
+    int runLoad(const std::string& path, size_t connection_count, std::ostream& os) {
+        const size_t lines_per_connection = 5000;
+        const size_t depth = 16;
+        std::vector<std::string> log = Bench::makeCommandLog(connection_count * lines_per_connection, 21);
+
+        int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        std::vector<LoadConnection> connections(connection_count);
+        for (size_t i = 0; i < connection_count; ++i) {
+            LoadConnection& conn = connections[i];
+            conn.script.assign(log.begin() + static_cast<std::ptrdiff_t>(i * lines_per_connection),
+                               log.begin() + static_cast<std::ptrdiff_t>((i + 1) * lines_per_connection));
+            prepare(conn);
+            conn.fd = connectTo(path);
+            if (conn.fd < 0) return 1;
+            fcntl(conn.fd, F_SETFL, fcntl(conn.fd, F_GETFL) | O_NONBLOCK);
+            epoll_event event{};
+            event.events = EPOLLIN | EPOLLOUT;
+            event.data.u64 = i;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn.fd, &event);
+        }
+
+        LatencyHistogram latency;
+        size_t finished = 0;
+        size_t mismatched = 0;
+        Clock::time_point start = Clock::now();
+        epoll_event events[256];
+        char buffer[64 * 1024];
+        while (finished < connection_count) {
+            int ready = epoll_wait(epoll_fd, events, 256, -1);
+            if (ready < 0 && errno != EINTR) break;
+            for (int e = 0; e < ready; ++e) {
+                LoadConnection& conn = connections[events[e].data.u64];
+                bool hung_up = false;
+                if (events[e].events & EPOLLIN) {
+                    ssize_t got;
+                    while ((got = read(conn.fd, buffer, sizeof(buffer))) > 0) {
+                        Clock::time_point now = Clock::now();
+                        std::string_view chunk(buffer, static_cast<size_t>(got));
+                        if (conn.expected.compare(conn.received, chunk.size(), chunk) != 0) conn.mismatch = true;
+                        conn.received += chunk.size();
+                        for (char c : chunk) {
+                            if (c != '\n' || conn.in_flight.empty()) continue;
+                            if (--conn.in_flight.front().second == 0) {
+                                latency.record(static_cast<uint64_t>(
+                                    std::chrono::duration_cast<std::chrono::nanoseconds>(now - conn.in_flight.front().first).count()));
+                                conn.in_flight.pop_front();
+                            }
+                        }
+                    }
+                    hung_up = got == 0;
+                }
+                // Top the pipeline up and send what fits
+                if (conn.out_offset == conn.out.size()) {
+                    conn.out.clear();
+                    conn.out_offset = 0;
+                    Clock::time_point now = Clock::now();
+                    while (conn.in_flight.size() < depth && conn.next_line < conn.script.size()) {
+                        conn.out += conn.script[conn.next_line];
+                        conn.out += '\n';
+                        if (uint32_t lines = conn.answer_lines[conn.next_line]) conn.in_flight.emplace_back(now, lines);
+                        ++conn.next_line;
+                    }
+                }
+                while (conn.out_offset < conn.out.size()) {
+                    ssize_t written = send(conn.fd, conn.out.data() + conn.out_offset, conn.out.size() - conn.out_offset, MSG_NOSIGNAL);
+                    if (written <= 0) break;
+                    conn.out_offset += static_cast<size_t>(written);
+                }
+                bool done = conn.next_line == conn.script.size() && conn.in_flight.empty() &&
+                            conn.out_offset == conn.out.size();
+                if (done || hung_up) {
+                    if (conn.mismatch || conn.received != conn.expected.size()) ++mismatched;
+                    ++finished;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn.fd, nullptr);
+                    close(conn.fd); // Ends the server-side session
+                }
+            }
+        }
+        Clock::duration elapsed = Clock::now() - start;
+        close(epoll_fd);
+
+        double seconds = std::chrono::duration<double>(elapsed).count();
+        size_t lines = connection_count * lines_per_connection;
+        os << "load: " << connection_count << " connections x " << lines_per_connection << " lines, " << depth
+           << " in flight per connection: " << seconds * 1000.0 << " ms (" << static_cast<double>(lines) / seconds
+           << " lines/s), " << mismatched << " connections with unexpected answers" << std::endl;
+        os << "  latency: p50 " << latency.percentile(0.50) / 1000.0 << " us, p99 " << latency.percentile(0.99) / 1000.0
+           << " us, max " << latency.max() / 1000.0 << " us over " << latency.count() << " answers" << std::endl;
+        return mismatched == 0 ? 0 : 1;
+    }
+} // namespace SocketClient
+#endif
+
+// True if standard input is a terminal, i.e. someone is typing commands
+bool stdinIsTerminal() {
+#if WITCHER_POSIX
+    return isatty(STDIN_FILENO) != 0;
+#else
+    return true;
+#endif
+}
+
+// Switches the standard streams to batch I/O: no stdio synchronisation and cin untied
+// from cout. Game output goes through OutputWriter; this only matters where stdin is
+// still read through std::cin. Must run before any I/O on the standard streams.
+void enableBatchIo() {
+    std::ios::sync_with_stdio(false);
+    std::cin.tie(nullptr);
+}
+
+// --report-stats: the game's EngineStats, as "Stats?" shows them, on stderr
+void printStats(const WitcherGame& game) {
+    OutputWriter text = OutputWriter::toMemory();
+    game.stats().print(text);
+    std::cerr << text.contents();
+}
+
+int main(int argc, char* argv[]) {
+    std::optional<RunOptions> options = RunOptions::fromArgs(argc, argv);
+    if (!options) {
+        std::cerr << "usage: " << argv[0] << " [--report-parse-allocations] [--batch|--interactive] [--input FILE] [--pipeline N [--report-pipeline] | --parallel N [--report-parallel]] [--bench parse|quantity|names|sessions|wal|replay] [--serve PATH [--shards N]] [--connect PATH] [--load PATH [--connections N]] [--load-snapshot FILE] [--save-snapshot FILE] [--wal FILE [--group-commit N] [--report-wal]] [--replay FILE [--seek N] [--checkpoint-every N] [--checkpoint-dir DIR [--verify]] [--report-replay]] [--report-stats]" << std::endl;
+        return 1;
+    }
+    if (!options->bench_name.empty()) {
+        if (!Bench::run(options->bench_name, std::cout)) {
+            std::cerr << "unknown benchmark: " << options->bench_name << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (!options->serve_path.empty() || !options->connect_path.empty() || !options->load_path.empty()) {
+#if WITCHER_EPOLL
+        if (!options->connect_path.empty()) {
+            return SocketClient::runPassThrough(options->connect_path);
+        }
+        if (!options->load_path.empty()) {
+            return SocketClient::runLoad(options->load_path, options->connections, std::cout);
+        }
+        size_t shards = options->shards > 0 ? options->shards : std::max<unsigned>(std::thread::hardware_concurrency(), 1u);
+        SocketServer server(shards);
+        if (!server.listenOn(options->serve_path)) {
+            return 1;
+        }
+        server.run();
+        server.report(std::cerr);
+        return 0;
+#else
+        std::cerr << "--serve, --connect and --load are not supported on this platform" << '\n';
+        return 1;
+#endif
+    }
 
-int main() {
+    bool batch = options->batch.value_or(!stdinIsTerminal());
+    if (batch) {
+        enableBatchIo();
+    }
+    std::unique_ptr<InputSource> input = openInput(options->input_path, batch);
+    if (!input) {
+        return 1;
+    }
+    OutputWriter out = OutputWriter::toFd(1);
+    if (!options->replay_path.empty()) { // The session continues from command N of the recording
+        ReplayEngine engine(options->checkpoint_interval);
+        if (!engine.open(options->replay_path, options->checkpoint_dir, options->verify_replay)) {
+            return 1;
+        }
+        if (!options->checkpoint_dir.empty() && !engine.build()) { // A lone seek in memory needs no checkpoints
+            return 1;
+        }
+        std::unique_ptr<WitcherGame> game = engine.seek(options->seek_command > 0 ? options->seek_command : ReplayEngine::END);
+        if (!game) {
+            return 1;
+        }
+        if (options->report_replay) {
+            engine.report(std::cerr);
+        }
+        game->run(*input, out, !batch);
+        if (options->report_stats) {
+            printStats(*game);
+        }
+        if (!options->save_snapshot_path.empty()) {
+            out.flush();
+            if (!game->saveSnapshot(options->save_snapshot_path)) {
+                return 1;
+            }
+        }
+        return 0;
+    }
     WitcherGame game;
-    game.run();
-    return 0; 
+    game.countParseAllocations(options->report_parse_allocations);
+    if (!options->load_snapshot_path.empty() && !game.loadSnapshot(options->load_snapshot_path)) {
+        return 1;
+    }
+    std::unique_ptr<CommandLog> log;
+    if (!options->wal_path.empty()) { // Recovery: the snapshot (if any), then the log's tail
+        log = std::make_unique<CommandLog>(options->group_commit);
+        auto replay = [&game](uint64_t sequence, std::string_view line) { game.applyLogged(line, sequence); };
+        if (!log->open(options->wal_path, game.logSequence(), replay)) {
+            return 1;
+        }
+    }
+    if (batch && options->pipeline_lanes > 0) { // Interactive sessions always run serially
+        CommandPipeline pipeline(options->pipeline_lanes);
+        pipeline.run(*input, game, out);
+        if (options->report_pipeline) {
+            pipeline.report(std::cerr);
+        }
+    } else if (batch && options->parallel_threads > 0) {
+        ParallelApplier applier(options->parallel_threads);
+        applier.run(*input, game, out);
+        if (options->report_parallel) {
+            applier.report(std::cerr);
+        }
+    } else {
+        game.run(*input, out, !batch, log.get());
+    }
+    if (options->report_parse_allocations) {
+        game.parseStats().report(std::cerr);
+    }
+    if (options->report_stats) {
+        printStats(game);
+    }
+    if (log && options->report_wal) {
+        log->report(std::cerr);
+    }
+    if (log && !log->ok()) {
+        return 1;
+    }
+    if (!options->save_snapshot_path.empty()) {
+        out.flush();
+        if (!game.saveSnapshot(options->save_snapshot_path)) {
+            return 1;
+        }
+        if (log && !log->checkpoint()) { // The snapshot now holds everything the log did
+            return 1;
+        }
+    }
+    return 0;
 }
\ No newline at end of file